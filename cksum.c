@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2016 Rafael Zalamena <rzalamena@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+
+#include "serverstatd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CKSUM_X86
+#include <immintrin.h>
+#endif /* __GNUC__ && (__x86_64__ || __i386__) */
+
+/*
+ * Vector loop iterations before spilling the 32 bit lane accumulators,
+ * each iteration adds two 16 bit words to every lane.
+ */
+#define CKSUM_SIMD_ROUNDS (16384)
+
+static void in_cksum_select(void);
+
+static int (*in_cksum_func)(const uint16_t *, int);
+
+/* Checksum `len` bytes with the best implementation for this CPU. */
+int
+in_cksum(const uint16_t *addr, int len)
+{
+	if (in_cksum_func == NULL)
+		in_cksum_select();
+
+	return (in_cksum_func(addr, len));
+}
+
+/*
+ * Shamelessly stolen from ping.c from OpenBSD.
+ *
+ * in_cksum_scalar --
+ *	Checksum routine for Internet Protocol family headers (C Version)
+ */
+int
+in_cksum_scalar(const uint16_t *addr, int len)
+{
+	int nleft = len;
+	const uint16_t *w = addr;
+	int sum = 0;
+	uint16_t answer = 0;
+
+	/*
+	 * Our algorithm is simple, using a 32 bit accumulator (sum), we add
+	 * sequential 16 bit words to it, and at the end, fold back all the
+	 * carry bits from the top 16 bits into the lower 16 bits.
+	 */
+	while (nleft > 1)  {
+		sum += *w++;
+		nleft -= 2;
+	}
+
+	/* mop up an odd byte, if necessary */
+	if (nleft == 1) {
+		*(u_char *)(&answer) = *(u_char *) w ;
+		sum += answer;
+	}
+
+	/* add back carry outs from top 16 bits to low 16 bits */
+	sum = (sum >> 16) + (sum & 0xffff);	/* add hi 16 to low 16 */
+	sum += (sum >> 16);			/* add carry */
+	answer = ~sum;				/* truncate to 16 bits */
+	return (answer);
+}
+
+#ifdef CKSUM_X86
+/* Sum the remaining words of a vectorized checksum and fold the result. */
+static inline int
+in_cksum_finish(uint64_t sum, const uint16_t *w, int nleft)
+{
+	uint16_t answer = 0;
+
+	while (nleft > 1) {
+		sum += *w++;
+		nleft -= 2;
+	}
+
+	if (nleft == 1) {
+		*(u_char *)(&answer) = *(const u_char *) w;
+		sum += answer;
+	}
+
+	while (sum >> 16)
+		sum = (sum >> 16) + (sum & 0xffff);
+
+	answer = ~sum;
+	return (answer);
+}
+
+/*
+ * Vectorized versions: zero extend 16 bit words into 32 bit lanes so
+ * carries are kept, then add the lanes together at the end.
+ */
+__attribute__((target("sse2")))
+static int
+in_cksum_sse2(const uint16_t *addr, int len)
+{
+	const u_char *p = (const u_char *) addr;
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc, v;
+	uint32_t lanes[4];
+	uint64_t sum = 0;
+	int n, i;
+
+	while (len >= 16) {
+		acc = _mm_setzero_si128();
+		for (n = 0; len >= 16 && n < CKSUM_SIMD_ROUNDS;
+		    n++, len -= 16, p += 16) {
+			v = _mm_loadu_si128((const __m128i *) p);
+			acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+			acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+		}
+
+		_mm_storeu_si128((__m128i *) lanes, acc);
+		for (i = 0; i < 4; i++)
+			sum += lanes[i];
+	}
+
+	return (in_cksum_finish(sum, (const uint16_t *) p, len));
+}
+
+__attribute__((target("avx2")))
+static int
+in_cksum_avx2(const uint16_t *addr, int len)
+{
+	const u_char *p = (const u_char *) addr;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i acc, v;
+	uint32_t lanes[8];
+	uint64_t sum = 0;
+	int n, i;
+
+	while (len >= 32) {
+		acc = _mm256_setzero_si256();
+		for (n = 0; len >= 32 && n < CKSUM_SIMD_ROUNDS;
+		    n++, len -= 32, p += 32) {
+			v = _mm256_loadu_si256((const __m256i *) p);
+			acc = _mm256_add_epi32(acc,
+			    _mm256_unpacklo_epi16(v, zero));
+			acc = _mm256_add_epi32(acc,
+			    _mm256_unpackhi_epi16(v, zero));
+		}
+
+		_mm256_storeu_si256((__m256i *) lanes, acc);
+		for (i = 0; i < 8; i++)
+			sum += lanes[i];
+	}
+
+	return (in_cksum_finish(sum, (const uint16_t *) p, len));
+}
+#endif /* CKSUM_X86 */
+
+/* Pick the checksum implementation based on the CPU features. */
+static void
+in_cksum_select(void)
+{
+#ifdef CKSUM_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		log_debug("using AVX2 checksum");
+		in_cksum_func = in_cksum_avx2;
+		return;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		log_debug("using SSE2 checksum");
+		in_cksum_func = in_cksum_sse2;
+		return;
+	}
+#endif /* CKSUM_X86 */
+
+	in_cksum_func = in_cksum_scalar;
+}
+
+/*
+ * Incremental checksum update (RFC 1624 equation 3):
+ *
+ *	HC' = ~(~HC + ~m + m')
+ *
+ * All values must be in the same byte order as the packet.
+ */
+uint16_t
+in_cksum_update(uint16_t cksum, uint16_t old, uint16_t new)
+{
+	uint32_t sum;
+
+	sum = (uint16_t) ~cksum + (uint16_t) ~old + new;
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum += (sum >> 16);
+	return (~sum);
+}
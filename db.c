@@ -92,7 +92,7 @@ db_vbindf(struct sqlite3_stmt *ss, const char *fmt, va_list vl)
 			break;
 		case 'd':
 			uinteger64 = va_arg(vl, uint64_t);
-			if (sqlite3_bind_int64(ss, column++, uinteger)
+			if (sqlite3_bind_int64(ss, column++, uinteger64)
 			    != SQLITE_OK)
 				return (-1);
 			break;
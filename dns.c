@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2016 Rafael Zalamena <rzalamena@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <strings.h>
+
+#include <event2/dns.h>
+
+#include "serverstatd.h"
+
+/*
+ * Probe name resolution.
+ *
+ * The parent resolves the probe names with the libevent asynchronous
+ * resolver and tells the worker owning each host when its address
+ * changes, the workers never block on DNS. Answers are cached per name
+ * and refreshed when their TTL expires; on failure the last address is
+ * kept and the query is retried later.
+ */
+
+/* Refresh bounds for the answer TTL, in seconds. */
+#define DNS_TTL_MIN (5)
+#define DNS_TTL_MAX (3600)
+/* Retry delay after a failed resolution, in seconds. */
+#define DNS_RETRY (15)
+
+struct dns_name {
+	TAILQ_ENTRY(dns_name) dn_entry;
+	char *dn_name;
+
+	/* Hosts using this name. */
+	struct icmp_host **dn_hosts;
+	size_t dn_hostcount;
+
+	/* Cached answer, AF_UNSPEC until the first one. */
+	struct sockaddr_storage dn_ss;
+
+	struct evdns_request *dn_req;
+	int dn_af; /* family of the last query */
+	struct event *dn_ev; /* refresh timer */
+};
+
+static TAILQ_HEAD(, dns_name) dnlist = TAILQ_HEAD_INITIALIZER(dnlist);
+static struct evdns_base *dnsbase;
+
+static void dns_resolve(struct dns_name *, int);
+
+static void
+dns_schedule(struct dns_name *dn, int secs)
+{
+	struct timeval tv = { secs, 0 };
+
+	evtimer_add(dn->dn_ev, &tv);
+}
+
+/* Tell the workers about the new address of the name. */
+static void
+dns_update(struct dns_name *dn, struct sockaddr_storage *ss)
+{
+	struct icmp_host_address iha;
+	struct icmp_host *ih;
+	char buf[INET6_ADDRSTRLEN];
+	size_t n;
+
+	if (ih_address_cmp(&dn->dn_ss, ss) == 0)
+		return;
+
+	memcpy(&dn->dn_ss, ss, sizeof(dn->dn_ss));
+	if (inet_ntop(ss->ss_family, (ss->ss_family == AF_INET6) ?
+	    (void *) &sstosin6(ss)->sin6_addr : (void *) &sstosin(ss)->sin_addr,
+	    buf, sizeof(buf)) == NULL)
+		strlcpy(buf, "invalid", sizeof(buf));
+	log_info("%s resolved to %s", dn->dn_name, buf);
+
+	memset(&iha, 0, sizeof(iha));
+	memcpy(&iha.iha_ss, ss, sizeof(iha.iha_ss));
+	for (n = 0; n < dn->dn_hostcount; n++) {
+		ih = dn->dn_hosts[n];
+		memcpy(&ih->ih_ss, ss, sizeof(ih->ih_ss));
+		iha.iha_index = ih->ih_index;
+		if (compose_to_worker(ih->ih_index, IMSG_HOST_ADDRESS, &iha,
+		    sizeof(iha)) == -1)
+			log_warnx("%s: failed to send address of %s",
+			    __FUNCTION__, ih->ih_name);
+	}
+}
+
+/*
+ * Pick the answer address: keep the current one if it is still in the
+ * answer, so round robin records don't move the probes around.
+ */
+static void
+dns_pick(struct dns_name *dn, int count, void *addresses,
+    struct sockaddr_storage *ss)
+{
+	struct in_addr *in = addresses;
+	struct in6_addr *in6 = addresses;
+	int n;
+
+	memset(ss, 0, sizeof(*ss));
+	ss->ss_family = dn->dn_af;
+#ifndef LINUX_SUPPORT
+	ss->ss_len = (dn->dn_af == AF_INET6) ? sizeof(struct sockaddr_in6) :
+	    sizeof(struct sockaddr_in);
+#endif /* LINUX_SUPPORT */
+	for (n = count - 1; n >= 0; n--) {
+		if (dn->dn_af == AF_INET6)
+			sstosin6(ss)->sin6_addr = in6[n];
+		else
+			sstosin(ss)->sin_addr = in[n];
+
+		/* Ends with the first one if the current one is gone. */
+		if (ih_address_cmp(&dn->dn_ss, ss) == 0)
+			return;
+	}
+}
+
+static void
+dns_callback(int result, char type, int count, int ttl, void *addresses,
+    void *arg)
+{
+	struct dns_name *dn = arg;
+	struct sockaddr_storage ss;
+
+	dn->dn_req = NULL;
+	if (result == DNS_ERR_SHUTDOWN || result == DNS_ERR_CANCEL)
+		return;
+
+	if (result == DNS_ERR_NONE && count > 0) {
+		dns_pick(dn, count, addresses, &ss);
+		dns_update(dn, &ss);
+		dns_schedule(dn, MIN(MAX(ttl, DNS_TTL_MIN), DNS_TTL_MAX));
+		return;
+	}
+
+	/* The name might have only IPv6 addresses. */
+	if (dn->dn_af == AF_INET && result != DNS_ERR_TIMEOUT) {
+		dns_resolve(dn, AF_INET6);
+		return;
+	}
+
+	log_warnx("unable to resolve %s: %s", dn->dn_name,
+	    (result != DNS_ERR_NONE) ? evdns_err_to_string(result) :
+	    "no address");
+	dns_schedule(dn, DNS_RETRY);
+}
+
+static void
+dns_resolve(struct dns_name *dn, int af)
+{
+	dn->dn_af = af;
+	if (af == AF_INET6)
+		dn->dn_req = evdns_base_resolve_ipv6(dnsbase, dn->dn_name, 0,
+		    dns_callback, dn);
+	else
+		dn->dn_req = evdns_base_resolve_ipv4(dnsbase, dn->dn_name, 0,
+		    dns_callback, dn);
+
+	if (dn->dn_req == NULL) {
+		log_warnx("%s: failed to query %s", __FUNCTION__, dn->dn_name);
+		dns_schedule(dn, DNS_RETRY);
+	}
+}
+
+static void
+dns_refresh(evutil_socket_t bula, short ev, void *arg)
+{
+	struct dns_name *dn = arg;
+
+	if (dn->dn_req != NULL)
+		return;
+
+	dns_resolve(dn, AF_INET);
+}
+
+/* Find or create the cache entry of a name. */
+static struct dns_name *
+dns_name_get(struct event_base *eb, const char *name)
+{
+	struct dns_name *dn;
+
+	TAILQ_FOREACH(dn, &dnlist, dn_entry) {
+		if (strcasecmp(dn->dn_name, name) == 0)
+			return (dn);
+	}
+
+	if ((dn = calloc(1, sizeof(*dn))) == NULL ||
+	    (dn->dn_name = strdup(name)) == NULL ||
+	    (dn->dn_ev = evtimer_new(eb, dns_refresh, dn)) == NULL)
+		fatal("%s", __FUNCTION__);
+
+	dn->dn_ss.ss_family = AF_UNSPEC;
+	TAILQ_INSERT_TAIL(&dnlist, dn, dn_entry);
+
+	return (dn);
+}
+
+/* Start resolving every probe configured by name. */
+void
+dns_init(struct event_base *eb)
+{
+	struct icmp_host *ih, **hosts;
+	struct dns_name *dn;
+	struct sockaddr_storage ss;
+	int n;
+
+	TAILQ_FOREACH(ih, &sc.sc_ihlist, ih_entry) {
+		if (ih_address_parse(ih->ih_address, &ss) == 0)
+			continue;
+
+		dn = dns_name_get(eb, ih->ih_address);
+		hosts = realloc(dn->dn_hosts,
+		    (dn->dn_hostcount + 1) * sizeof(*hosts));
+		if (hosts == NULL)
+			fatal("%s", __FUNCTION__);
+
+		hosts[dn->dn_hostcount++] = ih;
+		dn->dn_hosts = hosts;
+	}
+
+	if (TAILQ_EMPTY(&dnlist))
+		return;
+
+	if (sc.sc_nameservercount == 0)
+		dnsbase = evdns_base_new(eb, EVDNS_BASE_INITIALIZE_NAMESERVERS);
+	else
+		dnsbase = evdns_base_new(eb, 0);
+	if (dnsbase == NULL)
+		fatalx("failed to initialize the resolver");
+
+	for (n = 0; n < sc.sc_nameservercount; n++) {
+		if (evdns_base_nameserver_ip_add(dnsbase,
+		    sc.sc_nameservers[n]) != 0)
+			fatalx("invalid nameserver %s", sc.sc_nameservers[n]);
+	}
+
+	TAILQ_FOREACH(dn, &dnlist, dn_entry)
+		dns_resolve(dn, AF_INET);
+}
@@ -14,159 +14,2021 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#ifdef LINUX_SUPPORT
+/* Needed by recvmmsg() and sendmmsg() */
+#define _GNU_SOURCE
+#endif /* LINUX_SUPPORT */
+
+#include <fcntl.h>
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#include "serverstatd.h"
+#ifdef LINUX_SUPPORT
+#include <sys/mman.h>
+
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/sock_diag.h>
+#endif /* LINUX_SUPPORT */
+
+#include "serverstatd.h"
+
+#ifdef IO_URING_SUPPORT
+#include "uring.h"
+#endif /* IO_URING_SUPPORT */
+#ifdef XDP_SUPPORT
+#include "xdp.h"
+#endif /* XDP_SUPPORT */
+
+/* Maximum packets read from the raw socket with a single call. */
+#define ICMP_RECV_BATCH (32)
+/* Maximum batches drained before going back to the event loop. */
+#define ICMP_RECV_MAXBATCHES (8)
+#define ICMP_PKTBUF_LEN (1536)
+/* Kernel timestamps older than this are considered bogus. */
+#define ICMP_RECV_MAXLAG (10ULL * 1000000000ULL)
+/* Results ring records only host events may use. */
+#define ICMP_RING_EVENTROOM (PC_RING_RECORDS / 4)
+
+/* Maximum packets queued before forcing a transmit flush. */
+#define ICMP_SEND_BATCH (64)
+#define ICMP_SEND_LEN (512)
+/* Transmit batch size histogram buckets: 1, 2-3, 4-7, ..., 64. */
+#define ICMP_SEND_HISTLEN (7)
+
+/* Large enough for /proc/net/snmp6. */
+#define ICMP_SNMP_BUFLEN (16384)
+
+#ifdef LINUX_SUPPORT
+/*
+ * PACKET_MMAP receive ring: blocks are handed to us when full or after
+ * ICMP_PKT_BLOCKTMO milliseconds, whichever comes first.
+ */
+#define ICMP_PKT_BLOCKSIZE (1 << 18)
+#define ICMP_PKT_BLOCKNR (16)
+#define ICMP_PKT_FRAMESIZE (2048)
+#define ICMP_PKT_BLOCKTMO (TW_TICK_MS)
+#endif /* LINUX_SUPPORT */
+
+#ifdef IO_URING_SUPPORT
+/*
+ * Provided receive buffers: each holds the multishot recvmsg header,
+ * the source address, the control messages and the packet.
+ */
+#define ICMP_URING_BUFS (256)
+#define ICMP_URING_BUFLEN (2048)
+#define ICMP_URING_BGID (0)
+#endif /* IO_URING_SUPPORT */
+
+/* Per address family raw socket and its transmit queue */
+struct icmp_sock {
+	struct proc_ctx *is_pc;
+	int is_af;
+	int is_sd; /* Raw socket obtained with icmp_socket() */
+	int is_requested; /* asked the parent for the socket */
+	int is_armed; /* io_uring multishot receive running */
+	struct event *is_ev;
+	uint64_t is_rxpackets; /* replies the socket delivered to us */
+#ifdef LINUX_SUPPORT
+	/* PACKET_MMAP receive ring, see icmp_packet_socket(). */
+	int is_pktsd;
+	char *is_ring;
+	unsigned is_ringblock; /* next block to read */
+	struct event *is_pktev;
+	uint64_t is_pktdrops; /* ring overflows, reading them resets */
+#endif /* LINUX_SUPPORT */
+
+	/*
+	 * Transmit queue, flushed once per event loop iteration.
+	 *
+	 * Packet payloads are left zeroed, new_ip() only writes headers.
+	 */
+	int is_txcount;
+	char is_tbuf[ICMP_SEND_BATCH][ICMP_SEND_LEN];
+	struct icmp_host *is_tih[ICMP_SEND_BATCH]; /* NULL if send failed */
+	struct icmp_packet *is_tip[ICMP_SEND_BATCH]; /* NULL if stateless */
+	uint16_t is_tseq[ICMP_SEND_BATCH];
+	uint64_t is_tdue[ICMP_SEND_BATCH]; /* scheduled send time */
+	struct iovec is_tiov[ICMP_SEND_BATCH];
+#ifdef LINUX_SUPPORT
+	struct mmsghdr is_tmsg[ICMP_SEND_BATCH];
+#endif /* LINUX_SUPPORT */
+};
+
+struct icmp_probe_data;
+
+/*
+ * Probe socket I/O backend: libevent readiness callbacks followed by
+ * the socket system calls, or io_uring when built with it.
+ */
+struct icmp_io {
+	const char *io_name;
+	/* Start receiving from a socket we just got. */
+	int (*io_attach)(struct proc_ctx *, struct icmp_sock *);
+	/* Transmit the socket queue, clear is_tih of the failed packets. */
+	void (*io_send)(struct icmp_probe_data *, struct icmp_sock *);
+	/* Log the drops of its own receive path, optional. */
+	void (*io_drops)(struct proc_ctx *);
+};
+
+#ifdef IO_URING_SUPPORT
+struct icmp_uring {
+	struct uring iu_tx; /* batched sends, reaped in place */
+	struct uring iu_rx; /* multishot receives of both sockets */
+	struct uring_bufring iu_bufs;
+	struct event *iu_ev; /* completions pending */
+	struct msghdr iu_msg; /* receive buffer layout */
+	uint16_t iu_bid[ICMP_RECV_BATCH]; /* buffers of the batch */
+	struct icmp_sock *iu_is[ICMP_RECV_BATCH];
+};
+#endif /* IO_URING_SUPPORT */
+
+/* ICMP probe main data structure */
+struct icmp_probe_data {
+	/* Our share of the hosts, see icmp_shard(). */
+	uint32_t ipd_first;
+	uint32_t ipd_count;
+	uint16_t ipd_id; /* echo id of our probes */
+
+	struct icmp_sock ipd_is4;
+	struct icmp_sock ipd_is6;
+	struct event *ipd_txev; /* transmit queues flusher */
+	struct event *ipd_reportev; /* results flusher */
+	const struct icmp_io *ipd_io;
+#ifdef IO_URING_SUPPORT
+	struct icmp_uring *ipd_uring;
+#endif /* IO_URING_SUPPORT */
+
+	/* Probe deadlines, driven by a single periodic timer. */
+	struct timewheel ipd_tw;
+	struct event *ipd_twev;
+
+	/*
+	 * Send pacing: a token bucket of our share of icmp-pps, in
+	 * billionths of a packet. Zero pps means no limit.
+	 */
+	uint64_t ipd_pps;
+	uint64_t ipd_tokens;
+	uint64_t ipd_tokens_ts;
+
+	/* Hosts with an event waiting for room on the results ring. */
+	TAILQ_HEAD(, icmp_host) ipd_ihelist;
+
+	/* Receive batch buffers */
+	char ipd_rbuf[ICMP_RECV_BATCH][ICMP_PKTBUF_LEN];
+	char *ipd_rdata[ICMP_RECV_BATCH]; /* packet, in ipd_rbuf or not */
+	size_t ipd_rlen[ICMP_RECV_BATCH];
+	struct sockaddr_storage ipd_rss[ICMP_RECV_BATCH];
+	socklen_t ipd_rsslen[ICMP_RECV_BATCH];
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(struct timespec))];
+	} ipd_rcmsg[ICMP_RECV_BATCH];
+	uint64_t ipd_rts[ICMP_RECV_BATCH]; /* kernel receive time or 0 */
+#ifdef LINUX_SUPPORT
+	struct iovec ipd_riov[ICMP_RECV_BATCH];
+	struct mmsghdr ipd_rmsg[ICMP_RECV_BATCH];
+#endif /* LINUX_SUPPORT */
+
+	/* Transmit statistics */
+	uint64_t ipd_txbatches;
+	uint64_t ipd_txpackets;
+	uint64_t ipd_txerrors;
+	uint64_t ipd_txhist[ICMP_SEND_HISTLEN];
+	uint64_t ipd_txdeferred; /* probes delayed by the pacer */
+	uint64_t ipd_txsyscalls; /* socket I/O only, not the event loop */
+	struct rtt_stats ipd_txjitter; /* actual minus scheduled send time */
+
+	/* Receive statistics */
+	uint64_t ipd_rxpackets;
+	uint64_t ipd_rxsyscalls;
+	uint64_t ipd_rxstamped; /* packets with kernel timestamps */
+	uint64_t ipd_rxlag; /* total dispatch lag removed (ns) */
+	uint64_t ipd_rxlagmax;
+	uint64_t ipd_rxunreach; /* errors quoting one of our probes */
+	uint64_t ipd_rxtimxceed;
+};
+
+/* ICMP probe signal handler */
+static void
+icmp_handle_term(evutil_socket_t s, short ev, void *bula)
+{
+	log_debug("icmp probe received signal %d", s);
+
+	_exit(EXIT_SUCCESS);
+}
+
+/*
+ * Read the number of ICMP messages the host received, both families.
+ * The parent compares it with what got to the probes to tell how much
+ * the socket filters kept away from them, host-wide.
+ */
+int
+icmp_snmp_inmsgs(uint64_t *inmsgs)
+{
+#ifdef LINUX_SUPPORT
+	static const char *paths[] = { "/proc/net/snmp", "/proc/net/snmp6" };
+	static char buf[ICMP_SNMP_BUFLEN];
+	unsigned long long value;
+	ssize_t n;
+	char *p;
+	int fd, i;
+
+	/* Datagram sockets only see their own replies, there is no filter. */
+	if (sc.sc_icmp_socket != ICMP_SOCKET_RAW)
+		return (-1);
+
+	*inmsgs = 0;
+	for (i = 0; i < (int) NOF(sizeof(paths), sizeof(paths[0])); i++) {
+		/* No IPv6 on the host, nothing to count. */
+		if ((fd = open(paths[i], O_RDONLY)) == -1 && i == 1)
+			break;
+		if (fd == -1) {
+			log_warn("%s: open(%s)", __FUNCTION__, paths[i]);
+			return (-1);
+		}
+		n = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (n == -1) {
+			log_warn("%s: read(%s)", __FUNCTION__, paths[i]);
+			return (-1);
+		}
+		buf[n] = 0;
+
+		/* snmp has a line of names followed by a line of values. */
+		if (i == 1) {
+			if ((p = strstr(buf, "Icmp6InMsgs")) == NULL ||
+			    sscanf(p, "Icmp6InMsgs %llu", &value) != 1)
+				goto fail;
+		} else {
+			if ((p = strstr(buf, "\nIcmp: ")) == NULL ||
+			    (p = strstr(p + 1, "\nIcmp: ")) == NULL ||
+			    sscanf(p, "\nIcmp: %llu", &value) != 1)
+				goto fail;
+		}
+		*inmsgs += value;
+	}
+
+	return (0);
+
+ fail:
+	log_warnx("%s: unable to find the ICMP input counter", __FUNCTION__);
+	return (-1);
+#else
+	return (-1);
+#endif /* LINUX_SUPPORT */
+}
+
+/*
+ * Log the packets the socket delivered to us and the ones the kernel
+ * dropped because we didn't read it fast enough. The socket filter
+ * drops are not counted there, the parent estimates them host-wide.
+ */
+static void
+icmp_sock_stats(struct proc_ctx *pc, struct icmp_sock *is)
+{
+	const char *name = (is->is_af == AF_INET6) ? "ICMPv6" : "ICMP";
+#ifdef LINUX_SUPPORT
+	struct tpacket_stats_v3 tps;
+	uint32_t meminfo[SK_MEMINFO_VARS];
+	socklen_t len;
+#endif /* LINUX_SUPPORT */
+
+	if (is->is_sd == -1)
+		return;
+
+#ifdef LINUX_SUPPORT
+	/* With the packet I/O the raw socket filter lets nothing in. */
+	if (is->is_pktsd != -1) {
+		len = sizeof(tps);
+		if (getsockopt(is->is_pktsd, SOL_PACKET, PACKET_STATISTICS,
+		    &tps, &len) == -1) {
+			log_warn("%s: getsockopt(PACKET_STATISTICS)",
+			    __FUNCTION__);
+			return;
+		}
+		is->is_pktdrops += tps.tp_drops;
+		log_info("%s: %s packet socket: %llu packets delivered, "
+		    "%llu dropped, ring full", pc->pc_name, name,
+		    (unsigned long long) is->is_rxpackets,
+		    (unsigned long long) is->is_pktdrops);
+		return;
+	}
+
+	len = sizeof(meminfo);
+	if (getsockopt(is->is_sd, SOL_SOCKET, SO_MEMINFO, meminfo,
+	    &len) == -1) {
+		log_warn("%s: getsockopt(SO_MEMINFO)", __FUNCTION__);
+		return;
+	}
+	log_info("%s: %s socket: %llu packets delivered, %u dropped, "
+	    "receive queue full", pc->pc_name, name,
+	    (unsigned long long) is->is_rxpackets, meminfo[SK_MEMINFO_DROPS]);
+#else
+	log_info("%s: %s socket: %llu packets delivered", pc->pc_name, name,
+	    (unsigned long long) is->is_rxpackets);
+#endif /* LINUX_SUPPORT */
+}
+
+/* Log ICMP probe statistics. */
+static void
+icmp_handle_usr1(evutil_socket_t s, short ev, void *arg)
+{
+	struct proc_ctx *pc = arg;
+	struct icmp_probe_data *ipd = pc->pc_data;
+	int i;
+
+	log_info("%s: sent %llu packets in %llu batches, %llu errors",
+	    pc->pc_name, (unsigned long long) ipd->ipd_txpackets,
+	    (unsigned long long) ipd->ipd_txbatches,
+	    (unsigned long long) ipd->ipd_txerrors);
+	for (i = 0; i < ICMP_SEND_HISTLEN; i++)
+		log_info("%s: batches of %d-%d packets: %llu", pc->pc_name,
+		    1 << i, MIN((2 << i) - 1, ICMP_SEND_BATCH),
+		    (unsigned long long) ipd->ipd_txhist[i]);
+
+	log_info("%s: %llu probes deferred by the pacer", pc->pc_name,
+	    (unsigned long long) ipd->ipd_txdeferred);
+	if (ipd->ipd_txjitter.rs_count)
+		log_info("%s: send jitter avg %.3f ms, p99 %.3f ms, max %.3f ms",
+		    pc->pc_name, ipd->ipd_txjitter.rs_mean / 1e6,
+		    rtt_percentile(&ipd->ipd_txjitter, 99) / 1e6,
+		    ipd->ipd_txjitter.rs_max / 1e6);
+
+	log_info("%s: received %llu packets, %llu with kernel timestamps",
+	    pc->pc_name, (unsigned long long) ipd->ipd_rxpackets,
+	    (unsigned long long) ipd->ipd_rxstamped);
+	log_info("%s: received %llu unreachable and %llu time exceeded "
+	    "errors for our probes", pc->pc_name,
+	    (unsigned long long) ipd->ipd_rxunreach,
+	    (unsigned long long) ipd->ipd_rxtimxceed);
+	if (ipd->ipd_rxstamped)
+		log_info("%s: kernel timestamps removed %.3f ms average, "
+		    "%.3f ms max of dispatch lag", pc->pc_name,
+		    ipd->ipd_rxlag / 1e6 / ipd->ipd_rxstamped,
+		    ipd->ipd_rxlagmax / 1e6);
+
+	icmp_sock_stats(pc, &ipd->ipd_is4);
+	icmp_sock_stats(pc, &ipd->ipd_is6);
+	if (ipd->ipd_io->io_drops != NULL)
+		ipd->ipd_io->io_drops(pc);
+
+	/* For the host-wide filter estimate of the parent. */
+	if (compose_to_father(pc, IMSG_ICMP_STATS, &ipd->ipd_rxpackets,
+	    sizeof(ipd->ipd_rxpackets)) == -1)
+		log_warnx("%s: failed to send the statistics", __FUNCTION__);
+
+	if (ipd->ipd_txpackets || ipd->ipd_rxpackets)
+		log_info("%s: %s I/O: %.2f send and %.2f receive system calls "
+		    "per packet", pc->pc_name, ipd->ipd_io->io_name,
+		    ipd->ipd_txpackets ?
+		    (double) ipd->ipd_txsyscalls / ipd->ipd_txpackets : 0.0,
+		    ipd->ipd_rxpackets ?
+		    (double) ipd->ipd_rxsyscalls / ipd->ipd_rxpackets : 0.0);
+}
+
+/*
+ * Open a ping socket: the kernel sets the echo id, computes the checksum
+ * and only hands us replies to our own requests. Access is controlled by
+ * net.ipv4.ping_group_range.
+ */
+static int
+icmp_socket_dgram(int af)
+{
+	int s;
+
+	if (af == AF_INET)
+		s = socket(PF_INET, SOCK_DGRAM, IPPROTO_ICMP);
+	else
+		s = socket(PF_INET6, SOCK_DGRAM, IPPROTO_ICMPV6);
+	if (s == -1)
+		fatal("%s: datagram ICMP socket (family %d)", __FUNCTION__, af);
+
+	return (s);
+}
+
+/* Open a raw ICMP socket. */
+static int
+icmp_socket_raw(int af)
+{
+	struct icmp6_filter filt;
+	int s;
+
+	switch (af) {
+	case AF_INET:
+		if ((s = socket(PF_INET, SOCK_RAW, IPPROTO_ICMP)) == -1)
+			fatal("socket(PF_INET, SOCK_RAW, IPPROTO_ICMP)");
+		break;
+
+	case AF_INET6:
+		if ((s = socket(PF_INET6, SOCK_RAW, IPPROTO_ICMPV6)) == -1)
+			fatal("socket(PF_INET6, SOCK_RAW, IPPROTO_ICMPV6)");
+
+		/* Let the kernel drop everything but replies and errors. */
+		ICMP6_FILTER_SETBLOCKALL(&filt);
+		ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &filt);
+		ICMP6_FILTER_SETPASS(ICMP6_DST_UNREACH, &filt);
+		ICMP6_FILTER_SETPASS(ICMP6_TIME_EXCEEDED, &filt);
+		if (setsockopt(s, IPPROTO_ICMPV6, ICMP6_FILTER, &filt,
+		    sizeof(filt)) == -1)
+			fatal("setsockopt(ICMP6_FILTER)");
+		break;
+
+	default:
+		fatalx("%s: unsupported address family %d", __FUNCTION__, af);
+	}
+
+	return (s);
+}
+
+/*
+ * Split the hosts evenly between the workers, each one probes a
+ * contiguous range of host indexes.
+ */
+void
+icmp_shard(int instance, uint32_t *first, uint32_t *count)
+{
+	uint32_t last;
+
+	*first = (uint64_t) sc.sc_ihcount * instance / sc.sc_icmp_workers;
+	last = (uint64_t) sc.sc_ihcount * (instance + 1) / sc.sc_icmp_workers;
+	*count = last - *first;
+}
+
+/*
+ * Attach a socket filter to the raw socket so the kernel only wakes us
+ * up for echo replies and errors quoting one of our probes: the echo
+ * ids in [base, base + count). Each worker has its own echo id and raw
+ * socket, so this is also what keeps workers from seeing the replies of
+ * each other. The parent attaches it before handing the socket over,
+ * so no stray packet gets queued in between.
+ *
+ * Errors quote the original IP header, ours never carry options so the
+ * quoted ICMP header is right after 20 bytes (40 bytes for IPv6). The
+ * receive path still validates everything the filter lets through.
+ *
+ * `iphdr` tells the packets start with the IP header, which IPv4 raw
+ * sockets and packet sockets get but ICMPv6 raw sockets don't.
+ */
+static void
+icmp_socket_filter(int s, int af, int iphdr, uint16_t base, uint16_t count)
+{
+#ifdef LINUX_SUPPORT
+	struct sock_filter filter4[] = {
+		/* Only ICMP, for packet sockets. */
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMP, 0, 12),
+		/* X = IPv4 header length */
+		BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+		BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, 2, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_UNREACH, 3, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_TIMXCEED, 2, 7),
+		/* Echo reply id */
+		BPF_STMT(BPF_LD | BPF_H | BPF_IND, 4),
+		BPF_JUMP(BPF_JMP | BPF_JA, 1, 0, 0),
+		/* Quoted echo request id */
+		BPF_STMT(BPF_LD | BPF_H | BPF_IND, ICMP_MINLEN + 20 + 4),
+		/* (id - base) & 0xffff < count */
+		BPF_STMT(BPF_ALU | BPF_SUB | BPF_K, base),
+		BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xffff),
+		BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, count, 1, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	/*
+	 * ICMPv6 raw sockets don't see the IP header, packet sockets do:
+	 * skip the first two instructions and the header for the former.
+	 */
+	int off = iphdr ? sizeof(struct ip6_hdr) : 0;
+	struct sock_filter filter6[] = {
+		/* Only ICMPv6 without extension headers. */
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 6),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMPV6, 0, 11),
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, off),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP6_ECHO_REPLY, 2, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP6_DST_UNREACH, 3, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP6_TIME_EXCEEDED, 2, 7),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, off + 4),
+		BPF_JUMP(BPF_JMP | BPF_JA, 1, 0, 0),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, off + ICMP_MINLEN + 40 + 4),
+		BPF_STMT(BPF_ALU | BPF_SUB | BPF_K, base),
+		BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xffff),
+		BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, count, 1, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog prog;
+
+	if (af == AF_INET6) {
+		prog.filter = iphdr ? filter6 : &filter6[2];
+		prog.len = NOF(sizeof(filter6), sizeof(filter6[0])) -
+		    (iphdr ? 0 : 2);
+	} else {
+		prog.filter = filter4;
+		prog.len = NOF(sizeof(filter4), sizeof(filter4[0]));
+	}
+
+	if (setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+	    sizeof(prog)) == -1)
+		log_warn("%s: setsockopt(SO_ATTACH_FILTER)", __FUNCTION__);
+#endif /* LINUX_SUPPORT */
+}
+
+/*
+ * Create ICMP socket for the address family and worker.
+ *
+ * Ask the kernel to timestamp received packets, so the RTT doesn't
+ * include the time replies waited for the event loop.
+ */
+int
+icmp_socket(int af, int instance)
+{
+	int s = -1;
+	int on = 1;
+
+	if (sc.sc_icmp_socket == ICMP_SOCKET_DGRAM)
+		s = icmp_socket_dgram(af);
+	else {
+		s = icmp_socket_raw(af);
+		/* Replies go to the packet socket, this one only sends. */
+		icmp_socket_filter(s, af, af == AF_INET,
+		    sc.sc_icmp_idbase + instance,
+		    (sc.sc_icmp_io == ICMP_IO_PACKET) ? 0 : 1);
+	}
+
+#ifdef SO_TIMESTAMPNS
+	if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == -1)
+		log_warn("%s: setsockopt(SO_TIMESTAMPNS)", __FUNCTION__);
+#else
+	if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on)) == -1)
+		log_warn("%s: setsockopt(SO_TIMESTAMP)", __FUNCTION__);
+#endif /* SO_TIMESTAMPNS */
+
+	return (s);
+}
+
+/*
+ * Create the packet socket receiving the replies of a worker, when the
+ * packet I/O is in use: a TPACKET_V3 ring the worker maps and reads
+ * whole blocks of replies from, without a system call or a copy per
+ * packet. The socket filter is the raw socket one, attached before the
+ * socket is bound so nothing else gets in. Datagram packet sockets
+ * strip the link header, packets start with the IP header.
+ */
+int
+icmp_packet_socket(int af, int instance)
+{
+#ifdef LINUX_SUPPORT
+	struct tpacket_req3 req;
+	struct sockaddr_ll sll;
+	int s, version = TPACKET_V3, on = 1;
+
+	if ((s = socket(PF_PACKET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	    0)) == -1)
+		fatal("socket(PF_PACKET, SOCK_DGRAM)");
+
+	if (setsockopt(s, SOL_PACKET, PACKET_VERSION, &version,
+	    sizeof(version)) == -1)
+		fatal("setsockopt(PACKET_VERSION)");
+
+	icmp_socket_filter(s, af, 1, sc.sc_icmp_idbase + instance, 1);
+
+	/* Our own probes and loopback replies would show up twice. */
+	if (setsockopt(s, SOL_PACKET, PACKET_IGNORE_OUTGOING, &on,
+	    sizeof(on)) == -1)
+		log_warn("%s: setsockopt(PACKET_IGNORE_OUTGOING)", __FUNCTION__);
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = ICMP_PKT_BLOCKSIZE;
+	req.tp_block_nr = ICMP_PKT_BLOCKNR;
+	req.tp_frame_size = ICMP_PKT_FRAMESIZE;
+	req.tp_frame_nr = (ICMP_PKT_BLOCKSIZE / ICMP_PKT_FRAMESIZE) *
+	    ICMP_PKT_BLOCKNR;
+	req.tp_retire_blk_tov = ICMP_PKT_BLOCKTMO;
+	if (setsockopt(s, SOL_PACKET, PACKET_RX_RING, &req,
+	    sizeof(req)) == -1)
+		fatal("setsockopt(PACKET_RX_RING)");
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons((af == AF_INET6) ? ETH_P_IPV6 : ETH_P_IP);
+	if (bind(s, (struct sockaddr *) &sll, sizeof(sll)) == -1)
+		fatal("%s: bind", __FUNCTION__);
+
+	return (s);
+#else
+	return (-1);
+#endif /* LINUX_SUPPORT */
+}
+
+/*
+ * Stable phase of the host within `interval`, spreading the hosts evenly:
+ * the golden ratio sequence of the host indexes.
+ */
+static uint64_t
+ih_phase(struct icmp_host *ih, uint64_t interval)
+{
+	uint64_t frac = (uint32_t) (ih->ih_index * 2654435769U);
+
+	/* Milliseconds are enough and don't overflow. */
+	return (((interval / 1000000ULL) * frac >> 32) * 1000000ULL);
+}
+
+/* Run the host timer at monotonic time `t`. */
+static void
+ih_schedule_at(struct icmp_host *ih, uint64_t now, uint64_t t)
+{
+	struct icmp_probe_data *ipd = ih->ih_pc->pc_data;
+
+	ih->ih_due = t;
+	tw_add(&ipd->ipd_tw, &ih->ih_twe,
+	    (t > now) ? (t - now + 999999) / 1000000 : 0);
+}
+
+/*
+ * Schedule the next probe of the host at the first point of its grid,
+ * `phase + k * interval`, that is more than `margin` away.
+ */
+static void
+ih_schedule(struct icmp_host *ih, uint64_t interval, uint64_t margin)
+{
+	uint64_t now, t;
+
+	now = mono_ns();
+	t = now + margin;
+	ih->ih_slot = t - ((t + interval - ih_phase(ih, interval)) %
+	    interval) + interval;
+
+	ih_schedule_at(ih, now, ih->ih_slot);
+}
+
+/*
+ * Reschedule the host after sending it a probe.
+ *
+ * Probes stay on the host grid, so hosts don't synchronize over time.
+ * Half an interval of margin keeps a probe sent a little late from
+ * getting another one right away.
+ *
+ * Up hosts wait for the reply only until the timeout, a retry goes out
+ * then unless the reply moves the timer back to the grid slot.
+ */
+static void
+reschedule_icmp_send(struct icmp_host *ih)
+{
+	struct icmp_timing *it = &ih->ih_timing;
+	uint64_t deadline;
+
+	if (ih->ih_ihs != IHS_UP) {
+		/* Host went down, probe it less often. */
+		ih_schedule(ih, it->it_down_interval,
+		    it->it_down_interval / 2);
+		return;
+	}
+
+	ih_schedule(ih, it->it_interval, it->it_interval / 2);
+	if (it->it_timeout == 0)
+		return;
+
+	deadline = mono_ns() + it->it_timeout;
+	if (deadline < ih->ih_slot)
+		ih_schedule_at(ih, mono_ns(), deadline);
+}
+
+/*
+ * Refill the pacer bucket, it holds one tick worth of packets or a
+ * single packet, whichever is more.
+ */
+static void
+icmp_pace_refill(struct icmp_probe_data *ipd)
+{
+	uint64_t now, burst, elapsed;
+
+	if (ipd->ipd_pps == 0)
+		return;
+
+	now = mono_ns();
+	burst = MAX(ipd->ipd_pps * TW_TICK_NS, 1000000000ULL);
+	/* Clamp first, a long stall would overflow the product. */
+	elapsed = MIN(now - ipd->ipd_tokens_ts, burst / ipd->ipd_pps);
+	ipd->ipd_tokens += ipd->ipd_pps * elapsed;
+	if (ipd->ipd_tokens > burst)
+		ipd->ipd_tokens = burst;
+	ipd->ipd_tokens_ts = now;
+}
+
+/* Take a token for sending one probe, returns 0 if over budget. */
+static int
+icmp_pace_take(struct icmp_probe_data *ipd)
+{
+	if (ipd->ipd_pps == 0)
+		return (1);
+	if (ipd->ipd_tokens < 1000000000ULL)
+		return (0);
+
+	ipd->ipd_tokens -= 1000000000ULL;
+	return (1);
+}
+
+/* Give back a token taken for a probe that was not sent. */
+static void
+icmp_pace_give(struct icmp_probe_data *ipd)
+{
+	if (ipd->ipd_pps)
+		ipd->ipd_tokens += 1000000000ULL;
+}
+
+/* Account a transmit batch in the statistics. */
+static void
+icmp_send_account(struct icmp_probe_data *ipd, int count)
+{
+	int bucket;
+
+	for (bucket = 0; (2 << bucket) <= count &&
+	    bucket < (ICMP_SEND_HISTLEN - 1); bucket++)
+		/* NOTHING */;
+
+	ipd->ipd_txbatches++;
+	ipd->ipd_txhist[bucket]++;
+}
+
+/* Socket for the address family. */
+static struct icmp_sock *
+icmp_sock_af(struct icmp_probe_data *ipd, int af)
+{
+	return ((af == AF_INET6) ? &ipd->ipd_is6 : &ipd->ipd_is4);
+}
+
+/* Transmit the socket queue with the socket system calls. */
+static void
+icmp_event_send(struct icmp_probe_data *ipd, struct icmp_sock *is)
+{
+	struct icmp_host *ih;
+	int i, n;
+
+#ifdef LINUX_SUPPORT
+	for (i = 0; i < is->is_txcount; i += n) {
+		ipd->ipd_txsyscalls++;
+		n = sendmmsg(is->is_sd, &is->is_tmsg[i],
+		    is->is_txcount - i, 0);
+		if (n > 0)
+			continue;
+		if (n == -1 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+
+		/* Skip the packet that failed and go on with the rest. */
+		ih = is->is_tih[i];
+		log_warn("%s sendmmsg to %s (%s) failed", __FUNCTION__,
+		    ih->ih_name, ih->ih_address);
+		is->is_tih[i] = NULL;
+		ipd->ipd_txerrors++;
+		n = 1;
+	}
+#else
+	for (i = 0; i < is->is_txcount; i++) {
+		ih = is->is_tih[i];
+		ipd->ipd_txsyscalls++;
+		if (sendto(is->is_sd, is->is_tiov[i].iov_base,
+		    is->is_tiov[i].iov_len, 0, sstosa(&ih->ih_ss),
+		    slen_sa(sstosa(&ih->ih_ss))) > 0)
+			continue;
+
+		log_warn("%s sendto %s (%s) failed", __FUNCTION__,
+		    ih->ih_name, ih->ih_address);
+		is->is_tih[i] = NULL;
+		ipd->ipd_txerrors++;
+	}
+#endif /* LINUX_SUPPORT */
+}
+
+/* Transmit all packets queued on a socket. */
+static void
+icmp_sock_flush(struct icmp_probe_data *ipd, struct icmp_sock *is)
+{
+	struct icmp_host *ih;
+	uint64_t now;
+	int i;
+
+	if (is->is_txcount == 0)
+		return;
+
+	icmp_send_account(ipd, is->is_txcount);
+
+	now = mono_ns();
+	for (i = 0; i < is->is_txcount; i++) {
+		if (is->is_tip[i] != NULL)
+			is->is_tip[i]->ip_sent = now;
+		else
+			ip_stateless_stamp(is->is_tih[i], is->is_tbuf[i], now);
+	}
+
+	ipd->ipd_io->io_send(ipd, is);
+
+	for (i = 0; i < is->is_txcount; i++) {
+		if ((ih = is->is_tih[i]) == NULL)
+			continue;
+
+		ipd->ipd_txpackets++;
+		if (is->is_tdue[i] && now >= is->is_tdue[i])
+			rtt_update(&ipd->ipd_txjitter, now - is->is_tdue[i]);
+		log_debug("Sent %s (%s) ICMP(id %d, seq %d) packet",
+		    ih->ih_name, ih->ih_address, ih->ih_id, is->is_tseq[i]);
+	}
+
+	is->is_txcount = 0;
+}
+
+/* Transmit all queued packets. */
+static void
+icmp_send_flush(struct icmp_probe_data *ipd)
+{
+	icmp_sock_flush(ipd, &ipd->ipd_is4);
+	icmp_sock_flush(ipd, &ipd->ipd_is6);
+}
+
+/* Flush the transmit queue after the event loop ran all callbacks. */
+static void
+icmp_send_handler(evutil_socket_t bula, short ev, void *arg)
+{
+	struct proc_ctx *pc = arg;
+
+	icmp_send_flush(pc->pc_data);
+}
+
+/* Queue ICMP packet for transmission. */
+int
+icmp_send(struct icmp_host *ih, struct proc_ctx *pc)
+{
+	struct icmp_probe_data *ipd = pc->pc_data;
+	struct icmp_sock *is = icmp_sock_af(ipd, ih->ih_ss.ss_family);
+	struct icmp_packet *ip;
+	int n;
+
+	if (is->is_sd == -1) {
+		log_debug("%s: no socket for %s (%s) yet", __FUNCTION__,
+		    ih->ih_name, ih->ih_address);
+		reschedule_icmp_send(ih);
+		return (-1);
+	}
+
+	n = is->is_txcount++;
+	if (sc.sc_icmp_stateless) {
+		ip = NULL;
+		is->is_tseq[n] = new_ip_stateless(ih, is->is_tbuf[n],
+		    ICMP_SEND_LEN);
+	} else {
+		ip = new_ip(ih, is->is_tbuf[n], ICMP_SEND_LEN);
+		is->is_tseq[n] = ip->ip_seq;
+	}
+	loss_sent(&ih->ih_loss);
+
+	is->is_tih[n] = ih;
+	is->is_tip[n] = ip;
+	is->is_tdue[n] = ih->ih_due;
+	is->is_tiov[n].iov_base = is->is_tbuf[n];
+	is->is_tiov[n].iov_len = ICMP_SEND_LEN;
+#ifdef LINUX_SUPPORT
+	memset(&is->is_tmsg[n], 0, sizeof(is->is_tmsg[n]));
+	is->is_tmsg[n].msg_hdr.msg_name = sstosa(&ih->ih_ss);
+	is->is_tmsg[n].msg_hdr.msg_namelen = slen_sa(sstosa(&ih->ih_ss));
+	is->is_tmsg[n].msg_hdr.msg_iov = &is->is_tiov[n];
+	is->is_tmsg[n].msg_hdr.msg_iovlen = 1;
+#endif /* LINUX_SUPPORT */
+
+	if (is->is_txcount == ICMP_SEND_BATCH)
+		icmp_sock_flush(ipd, is);
+	else if (n == 0)
+		event_active(ipd->ipd_txev, EV_TIMEOUT, 1);
+
+	reschedule_icmp_send(ih);
+
+	return (0);
+}
+
+/* Extract the kernel receive timestamp (wall clock) from a message. */
+static uint64_t
+icmp_cmsg_timestamp(struct msghdr *msg)
+{
+	struct cmsghdr *cmsg;
+	struct timeval tv;
+#ifdef SO_TIMESTAMPNS
+	struct timespec ts;
+#endif /* SO_TIMESTAMPNS */
+
+	if (msg->msg_flags & MSG_CTRUNC)
+		return (0);
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET)
+			continue;
+
+		switch (cmsg->cmsg_type) {
+#ifdef SO_TIMESTAMPNS
+		case SCM_TIMESTAMPNS:
+			memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+			return ((uint64_t) ts.tv_sec * 1000000000ULL +
+			    ts.tv_nsec);
+#endif /* SO_TIMESTAMPNS */
+		case SCM_TIMESTAMP:
+			memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+			return ((uint64_t) tv.tv_sec * 1000000000ULL +
+			    tv.tv_usec * 1000ULL);
+		}
+	}
+
+	return (0);
+}
+
+#ifdef LINUX_SUPPORT
+/* Read a batch of packets from the raw socket with a single call. */
+static int
+icmp_recv_batch(struct icmp_probe_data *ipd, struct icmp_sock *is)
+{
+	struct msghdr *msg;
+	int i, n;
+
+	for (i = 0; i < ICMP_RECV_BATCH; i++) {
+		ipd->ipd_riov[i].iov_base = ipd->ipd_rbuf[i];
+		ipd->ipd_riov[i].iov_len = sizeof(ipd->ipd_rbuf[i]);
+
+		msg = &ipd->ipd_rmsg[i].msg_hdr;
+		msg->msg_name = &ipd->ipd_rss[i];
+		msg->msg_namelen = sizeof(ipd->ipd_rss[i]);
+		msg->msg_iov = &ipd->ipd_riov[i];
+		msg->msg_iovlen = 1;
+		msg->msg_control = ipd->ipd_rcmsg[i].buf;
+		msg->msg_controllen = sizeof(ipd->ipd_rcmsg[i].buf);
+		msg->msg_flags = 0;
+	}
+
+	ipd->ipd_rxsyscalls++;
+	n = recvmmsg(is->is_sd, ipd->ipd_rmsg, ICMP_RECV_BATCH, MSG_DONTWAIT,
+	    NULL);
+	if (n == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return (0);
+
+		fatal("recvmmsg failed");
+	}
+
+	for (i = 0; i < n; i++) {
+		ipd->ipd_rdata[i] = ipd->ipd_rbuf[i];
+		ipd->ipd_rlen[i] = ipd->ipd_rmsg[i].msg_len;
+		ipd->ipd_rsslen[i] = ipd->ipd_rmsg[i].msg_hdr.msg_namelen;
+		ipd->ipd_rts[i] = icmp_cmsg_timestamp(
+		    &ipd->ipd_rmsg[i].msg_hdr);
+	}
+
+	return (n);
+}
+#else
+/* Read packets one by one until the batch fills or the socket drains. */
+static int
+icmp_recv_batch(struct icmp_probe_data *ipd, struct icmp_sock *is)
+{
+	struct msghdr msg;
+	struct iovec iov[1];
+	ssize_t bytesread;
+	int n;
+
+	for (n = 0; n < ICMP_RECV_BATCH; n++) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &ipd->ipd_rss[n];
+		msg.msg_namelen = sizeof(ipd->ipd_rss[n]);
+		iov[0].iov_base = ipd->ipd_rbuf[n];
+		iov[0].iov_len = sizeof(ipd->ipd_rbuf[n]);
+		msg.msg_iov = iov;
+		msg.msg_iovlen = NOF(sizeof(iov), sizeof(iov[0]));
+		msg.msg_control = ipd->ipd_rcmsg[n].buf;
+		msg.msg_controllen = sizeof(ipd->ipd_rcmsg[n].buf);
+		ipd->ipd_rxsyscalls++;
+		if ((bytesread = recvmsg(is->is_sd, &msg, MSG_DONTWAIT)) == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == EINTR)
+				break;
+
+			fatal("recvmsg failed");
+		}
+
+		ipd->ipd_rdata[n] = ipd->ipd_rbuf[n];
+		ipd->ipd_rlen[n] = bytesread;
+		ipd->ipd_rsslen[n] = msg.msg_namelen;
+		ipd->ipd_rts[n] = icmp_cmsg_timestamp(&msg);
+	}
+
+	return (n);
+}
+#endif /* LINUX_SUPPORT */
+
+/*
+ * Helper function to hide ping parse.
+ *
+ * IPv4 raw sockets return the IP header, IPv6 and datagram sockets start
+ * at the ICMP header. ICMPv6 echo messages share the ICMP echo header
+ * layout, so both are returned as `struct icmp`.
+ */
+static int
+icmp_parse(int af, char *p, size_t bytesread, struct sockaddr_storage *ss,
+    socklen_t sslen, struct ip **ip, struct icmp **icmp, size_t *icmplen)
+{
+	size_t iplen;
+	struct sockaddr *sa = sstosa(ss);
+
+	if (sslen < sizeof(struct sockaddr_in) || sa->sa_family != af) {
+		log_debug("unsupported family %d", sa->sa_family);
+		return (-1);
+	}
+
+	if (af == AF_INET6 || sc.sc_icmp_socket == ICMP_SOCKET_DGRAM) {
+		if ((af == AF_INET6 && sslen < sizeof(struct sockaddr_in6)) ||
+		    bytesread < ICMP_MINLEN) {
+			log_debug("packet too small");
+			return (-1);
+		}
+
+		*ip = NULL;
+		*icmp = (struct icmp *) p;
+		*icmplen = bytesread;
+		return (0);
+	}
+
+	*ip = (struct ip *) p;
+	iplen = (*ip)->ip_hl << 2;
+	if (bytesread < (iplen + ICMP_MINLEN)) {
+		log_debug("packet too small");
+		return (-1);
+	}
+
+	*icmp = (struct icmp *) (p + iplen);
+	*icmplen = bytesread - iplen;
+
+	return (0);
+}
+
+/* Move the held back host events to the results ring, oldest first. */
+static void
+icmp_ihe_drain(struct proc_ctx *pc)
+{
+	struct icmp_probe_data *ipd = pc->pc_data;
+	struct icmp_record *ir;
+	struct icmp_host *ih;
+
+	while ((ih = TAILQ_FIRST(&ipd->ipd_ihelist)) != NULL) {
+		if ((ir = shmring_reserve(&pc->pc_ring, 0)) == NULL)
+			break;
+
+		ir->ir_type = IR_EVENT;
+		memcpy(&ir->ir_event, &ih->ih_ihe, sizeof(ir->ir_event));
+		TAILQ_REMOVE(&ipd->ipd_ihelist, ih, ih_iheentry);
+		ih->ih_ihepending = 0;
+	}
+}
+
+/* Publish the results of this loop iteration to the parent. */
+static void
+icmp_report_handler(evutil_socket_t sd, short ev, void *arg)
+{
+	struct proc_ctx *pc = arg;
+
+	icmp_ihe_drain(pc);
+	shmring_publish(&pc->pc_ring);
+}
+
+/*
+ * Report the host state change to the parent on the results ring, the
+ * only channel they take so the parent logs them in order. If the parent
+ * fell that much behind the change is held back in the host until the
+ * ring drains, the timer wheel tick retries. A host holds a single
+ * change, a newer one replaces it: the backlog is bounded by the hosts
+ * and the parent always ends up with their current state.
+ */
+static void
+ih_event(struct icmp_host *ih)
+{
+	struct proc_ctx *pc = ih->ih_pc;
+	struct icmp_probe_data *ipd = pc->pc_data;
+	struct icmp_record *ir;
+
+	if (TAILQ_EMPTY(&ipd->ipd_ihelist) &&
+	    (ir = shmring_reserve(&pc->pc_ring, 0)) != NULL) {
+		ir->ir_type = IR_EVENT;
+		ih_event_init(ih, &ir->ir_event);
+	} else {
+		if (!ih->ih_ihepending) {
+			TAILQ_INSERT_TAIL(&ipd->ipd_ihelist, ih, ih_iheentry);
+			ih->ih_ihepending = 1;
+		}
+		ih_event_init(ih, &ih->ih_ihe);
+	}
+	event_active(ipd->ipd_reportev, EV_TIMEOUT, 1);
+}
+
+/* Report a RTT sample, samples leave room on the ring for the events. */
+static void
+ih_rtt_report(struct icmp_host *ih, uint64_t rtt)
+{
+	struct proc_ctx *pc = ih->ih_pc;
+	struct icmp_probe_data *ipd = pc->pc_data;
+	struct icmp_record *ir;
+
+	if ((ir = shmring_reserve(&pc->pc_ring,
+	    ICMP_RING_EVENTROOM)) == NULL) {
+		shmring_drop(&pc->pc_ring);
+		return;
+	}
+
+	ir->ir_type = IR_RTT;
+	ir->ir_rtt.ihr_index = ih->ih_index;
+	ir->ir_rtt.ihr_rtt = rtt;
+	event_active(ipd->ipd_reportev, EV_TIMEOUT, 1);
+}
+
+/* Take the host down right away. */
+static void
+ih_down(struct icmp_host *ih)
+{
+	log_debug("%s (%s) is down", ih->ih_name, ih->ih_address);
+	ih->ih_ihs = IHS_DOWN;
+
+	ih_event(ih);
+
+	/* Don't bother expecting response from a down host. */
+	free_ip_all(ih);
+
+	/* Host just went down, reschedule it for later. */
+	reschedule_icmp_send(ih);
+}
+
+/*
+ * Handle an ICMP error quoting one of our probes: destination unreachable
+ * takes the host down right away. Time exceeded only ends the probe, it is
+ * counted as lost once, when its deadline expires in ih_timeout().
+ *
+ * When the quote carries our payload the probe is authenticated like the
+ * replies are. Otherwise (only 8 bytes of ICMP quoted) the destination,
+ * the echo id and the sequence of a probe in flight must match, which
+ * only stateful mode can check: stateless mode has nothing to verify the
+ * quote against, so the error is ignored and the probe times out.
+ * Datagram sockets report errors in their error queue, they don't get
+ * here.
+ */
+static void
+icmp_recv_error(struct proc_ctx *pc, int af, struct icmp *icmp,
+    size_t icmplen)
+{
+	struct icmp_probe_data *ipd = pc->pc_data;
+	struct icmp_host *ih;
+	struct icmp_packet *ipkt = NULL;
+	struct ih_payload ihp;
+	struct icmp *eicmp;
+	struct ip *eip;
+	struct ip6_hdr *eip6;
+	const void *dst;
+	size_t hlen, elen;
+	uint32_t cookie;
+	uint16_t seq;
+	int unreach;
+
+	if (af == AF_INET) {
+		if (in_cksum((uint16_t *) icmp, icmplen) != 0) {
+			log_debug("received ICMP error with bad checksum");
+			return;
+		}
+
+		/* Path MTU discovery, not an outage. */
+		if (icmp->icmp_type == ICMP_UNREACH &&
+		    icmp->icmp_code == ICMP_UNREACH_NEEDFRAG)
+			return;
+
+		unreach = (icmp->icmp_type == ICMP_UNREACH);
+		if (icmplen < ICMP_MINLEN + sizeof(*eip))
+			goto tooshort;
+		eip = (struct ip *) ((char *) icmp + ICMP_MINLEN);
+		hlen = eip->ip_hl << 2;
+		if (eip->ip_p != IPPROTO_ICMP || hlen < sizeof(*eip))
+			goto notours;
+		dst = &eip->ip_dst;
+	} else {
+		unreach = (icmp->icmp_type == ICMP6_DST_UNREACH);
+		hlen = sizeof(*eip6);
+		if (icmplen < ICMP_MINLEN + hlen)
+			goto tooshort;
+		eip6 = (struct ip6_hdr *) ((char *) icmp + ICMP_MINLEN);
+		if (eip6->ip6_nxt != IPPROTO_ICMPV6)
+			goto notours;
+		dst = &eip6->ip6_dst;
+	}
+
+	if (icmplen < ICMP_MINLEN + hlen + ICMP_MINLEN)
+		goto tooshort;
+	eicmp = (struct icmp *) ((char *) icmp + ICMP_MINLEN + hlen);
+	elen = icmplen - ICMP_MINLEN - hlen;
+	if (eicmp->icmp_type !=
+	    ((af == AF_INET6) ? ICMP6_ECHO_REQUEST : ICMP_ECHO) ||
+	    ntohs(eicmp->icmp_id) != ipd->ipd_id)
+		goto notours;
+
+	seq = ntohs(eicmp->icmp_seq);
+	if (elen >= IH_TMPL_LEN) {
+		memcpy(&ihp, (char *) eicmp + ICMP_MINLEN, sizeof(ihp));
+		if ((ih = find_ih(ntohl(ihp.ihp_index))) == NULL)
+			goto notours;
+		cookie = ih_mac(ih, loss_probe(&ih->ih_loss, seq),
+		    ihp.ihp_sent);
+		if (ntohl(ihp.ihp_cookie) != cookie)
+			goto notours;
+	} else if (sc.sc_icmp_stateless) {
+		log_debug("ICMP error without our payload, ignoring");
+		return;
+	} else if ((ih = find_ih_addr(af, dst)) == NULL)
+		goto notours;
+
+	if (!sc.sc_icmp_stateless && (ipkt = find_ip(ih, seq)) == NULL) {
+		log_debug("received ICMP error for packet not in flight: %d",
+		    seq);
+		return;
+	}
+
+	log_debug("%s (%s) seq %d: %s (code %d)", ih->ih_name,
+	    ih->ih_address, seq, unreach ? "unreachable" : "time exceeded",
+	    icmp->icmp_code);
+	if (unreach)
+		ipd->ipd_rxunreach++;
+	else
+		ipd->ipd_rxtimxceed++;
+
+	if (ipkt != NULL)
+		free_ip(ih, ipkt);
+
+	if (unreach && ih->ih_ihs == IHS_UP)
+		ih_down(ih);
+	return;
+
+ tooshort:
+	log_debug("ICMP error too small");
+	return;
+
+ notours:
+	log_debug("received ICMP error, but it's not for us");
+}
+
+/* Handle a single received packet, `rxtime` is monotonic. */
+static void
+icmp_recv(struct proc_ctx *pc, int af, char *buf, size_t buflen,
+    struct sockaddr_storage *ss, socklen_t sslen, uint64_t rxtime)
+{
+	struct ip *ip;
+	struct icmp *icmp;
+	struct icmp_host *ih;
+	struct icmp_packet *ipkt;
+	struct ih_payload ihp;
+	size_t icmplen;
+	uint64_t sent, rtt;
+	uint16_t seq;
+	enum loss_event le;
+	uint8_t type;
+
+	if (icmp_parse(af, buf, buflen, ss, sslen, &ip, &icmp, &icmplen))
+		return;
+
+	type = icmp->icmp_type;
+	if (type != ((af == AF_INET6) ? ICMP6_ECHO_REPLY : ICMP_ECHOREPLY)) {
+		if ((af == AF_INET && (type == ICMP_UNREACH ||
+		    type == ICMP_TIMXCEED)) || (af == AF_INET6 &&
+		    (type == ICMP6_DST_UNREACH || type == ICMP6_TIME_EXCEEDED)))
+			icmp_recv_error(pc, af, icmp, icmplen);
+		else
+			log_debug("received ICMP type %d", type);
+		return;
+	}
+
+	/*
+	 * The probe identity is in the payload, datagram sockets own the
+	 * header id.
+	 */
+	if (icmplen < IH_TMPL_LEN) {
+		log_debug("packet too small");
+		return;
+	}
+	memcpy(&ihp, (char *) icmp + ICMP_MINLEN, sizeof(ihp));
+	if ((ih = find_ih(ntohl(ihp.ihp_index))) == NULL) {
+		log_debug("received ICMP packet, but it's not for us");
+		return;
+	}
+
+	/* The kernel already verified ICMPv6 checksums for us. */
+	if (af == AF_INET && in_cksum((uint16_t *) icmp, icmplen) != 0) {
+		log_debug("received ICMP packet with bad checksum");
+		return;
+	}
+
+	seq = ntohs(icmp->icmp_seq);
+	if (ntohl(ihp.ihp_cookie) !=
+	    ih_mac(ih, loss_probe(&ih->ih_loss, seq), ihp.ihp_sent) ||
+	    ihp.ihp_sent > rxtime) {
+		log_debug("received ICMP packet with bad MAC for %s (%s)",
+		    ih->ih_name, ih->ih_address);
+		return;
+	}
+
+	if (sc.sc_icmp_stateless) {
+		/*
+		 * Everything comes from the reply: late and reordered
+		 * replies are still good samples.
+		 */
+		if (loss_recv(&ih->ih_loss, seq) == LOSS_DUP) {
+			log_debug("received duplicated packet: %d", seq);
+			return;
+		}
+		ipkt = NULL;
+		sent = ihp.ihp_sent;
+	} else {
+		le = loss_recv(&ih->ih_loss, seq);
+		if ((ipkt = find_ip(ih, seq)) == NULL) {
+			/* Only account it, the send time is gone. */
+			switch (le) {
+			case LOSS_NEW:
+				log_debug("received packet with no send time: "
+				    "%d", seq);
+				break;
+			case LOSS_DUP:
+				log_debug("received duplicated packet: %d",
+				    seq);
+				break;
+			case LOSS_LATE:
+				log_debug("received late packet: %d", seq);
+				break;
+			}
+			return;
+		}
+		sent = ipkt->ip_sent;
+	}
+
+	rtt = rxtime - sent;
+	rtt_update(&ih->ih_rtt, rtt);
+	loss_rtt(&ih->ih_loss, rtt);
+	ih_rtt_report(ih, rtt);
+	log_debug("%s (%s) seq %d rtt %.3f ms", ih->ih_name, ih->ih_address,
+	    seq, rtt / 1e6);
+
+	if (ih->ih_ihs == IHS_DOWN) {
+		log_debug("%s (%s) is up", ih->ih_name, ih->ih_address);
+		ih->ih_ihs = IHS_UP;
+		ih_event(ih);
+
+		/* Back to the up interval. */
+		ih_schedule(ih, ih->ih_timing.it_interval,
+		    ih->ih_timing.it_interval / 2);
+	} else if (ih->ih_due < ih->ih_slot) {
+		/* Answered in time, no retry: wait for the grid slot. */
+		ih_schedule_at(ih, mono_ns(), ih->ih_slot);
+	}
+
+	ih->ih_retrycount = ih->ih_timing.it_retry;
+
+	if (ipkt != NULL)
+		free_ip(ih, ipkt);
+}
+
+/* Handle the packet in slot `i` of the receive batch. */
+static void
+icmp_recv_slot(struct icmp_sock *is, int i, uint64_t now, uint64_t realnow)
+{
+	struct proc_ctx *pc = is->is_pc;
+	struct icmp_probe_data *ipd = pc->pc_data;
+	uint64_t lag, rxtime;
+
+	/* Move the receive time back by how long the packet waited for us. */
+	rxtime = now;
+	if (ipd->ipd_rts[i] && ipd->ipd_rts[i] <= realnow &&
+	    (lag = realnow - ipd->ipd_rts[i]) < ICMP_RECV_MAXLAG) {
+		rxtime -= lag;
+		ipd->ipd_rxstamped++;
+		ipd->ipd_rxlag += lag;
+		if (lag > ipd->ipd_rxlagmax)
+			ipd->ipd_rxlagmax = lag;
+	}
+
+	ipd->ipd_rxpackets++;
+	is->is_rxpackets++;
+	icmp_recv(pc, is->is_af, ipd->ipd_rdata[i], ipd->ipd_rlen[i],
+	    &ipd->ipd_rss[i], ipd->ipd_rsslen[i], rxtime);
+}
+
+/*
+ * Raw socket handler.
+ *
+ * Drain the socket in batches, but give the event loop a chance to run
+ * after ICMP_RECV_MAXBATCHES so a reply storm doesn't starve timers.
+ */
+static void
+icmp_raw_socket_handler(evutil_socket_t sd, short ev, void *arg)
+{
+	struct icmp_sock *is = arg;
+	struct proc_ctx *pc = is->is_pc;
+	struct icmp_probe_data *ipd = pc->pc_data;
+	uint64_t now, realnow;
+	int batches, i, n;
+
+	for (batches = 0; batches < ICMP_RECV_MAXBATCHES; batches++) {
+		n = icmp_recv_batch(ipd, is);
+		now = mono_ns();
+		realnow = real_ns();
+		for (i = 0; i < n; i++)
+			icmp_recv_slot(is, i, now, realnow);
+
+		if (n < ICMP_RECV_BATCH)
+			break;
+	}
+}
+
+/* Receive on the socket with libevent readiness callbacks. */
+static int
+icmp_event_attach(struct proc_ctx *pc, struct icmp_sock *is)
+{
+	is->is_ev = event_new(pc->pc_eb, is->is_sd, EV_READ | EV_PERSIST,
+	    icmp_raw_socket_handler, is);
+	if (is->is_ev == NULL)
+		return (-1);
+
+	return (event_add(is->is_ev, NULL));
+}
+
+static const struct icmp_io icmp_io_event = {
+	.io_name = "event",
+	.io_attach = icmp_event_attach,
+	.io_send = icmp_event_send,
+};
+
+#ifdef IO_URING_SUPPORT
+/*
+ * io_uring backend.
+ *
+ * Each socket keeps a multishot recvmsg armed, replies land in provided
+ * buffers and only their completions wake the event loop, so receiving
+ * costs no system calls at all. Sends are submitted and reaped in one
+ * io_uring_enter() per batch on a ring of their own, which keeps their
+ * completions from mixing with the receive ones.
+ */
+
+/* Arm the multishot receive of the socket. */
+static int
+icmp_uring_arm(struct icmp_probe_data *ipd, struct icmp_sock *is)
+{
+	struct icmp_uring *iu = ipd->ipd_uring;
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_get_sqe(&iu->iu_rx)) == NULL)
+		return (-1);
 
-/* ICMP probe main data structure */
-struct icmp_probe_data {
-	int ipd_sd; /* Raw socket obtained with icmp_socket() */
-	struct event *ipd_sdev;
-};
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = is->is_sd;
+	sqe->addr = (uintptr_t) &iu->iu_msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = ICMP_URING_BGID;
+	sqe->user_data = is->is_af;
 
-/* ICMP probe signal handler */
+	ipd->ipd_rxsyscalls++;
+	if (uring_submit(&iu->iu_rx, 0) == -1) {
+		log_warn("%s: io_uring_enter", __FUNCTION__);
+		return (-1);
+	}
+
+	is->is_armed = 1;
+	return (0);
+}
+
+/*
+ * Unpack a multishot recvmsg buffer into slot `i` of the receive batch:
+ * the header is followed by areas of the sizes asked in iu_msg for the
+ * address and the control messages, then comes the packet.
+ */
+static int
+icmp_uring_unpack(struct icmp_probe_data *ipd, int i, char *buf, size_t len)
+{
+	struct icmp_uring *iu = ipd->ipd_uring;
+	struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *) buf;
+	struct msghdr msg;
+	size_t hlen;
+
+	hlen = sizeof(*out) + iu->iu_msg.msg_namelen +
+	    iu->iu_msg.msg_controllen;
+	if (len < hlen)
+		return (-1);
+
+	memcpy(&ipd->ipd_rss[i], buf + sizeof(*out),
+	    MIN(out->namelen, iu->iu_msg.msg_namelen));
+	ipd->ipd_rsslen[i] = MIN(out->namelen, iu->iu_msg.msg_namelen);
+	ipd->ipd_rdata[i] = buf + hlen;
+	ipd->ipd_rlen[i] = MIN(out->payloadlen, len - hlen);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_control = buf + sizeof(*out) + iu->iu_msg.msg_namelen;
+	msg.msg_controllen = MIN(out->controllen, iu->iu_msg.msg_controllen);
+	msg.msg_flags = out->flags;
+	ipd->ipd_rts[i] = icmp_cmsg_timestamp(&msg);
+
+	return (0);
+}
+
+/*
+ * The kernel has no multishot recvmsg, rearming it would only fail again:
+ * go on with the event backend, reading the same sockets.
+ */
 static void
-icmp_handle_term(evutil_socket_t s, short ev, void *bula)
+icmp_uring_fallback(struct proc_ctx *pc)
 {
-	log_debug("icmp probe received signal %d", s);
+	struct icmp_probe_data *ipd = pc->pc_data;
 
-	_exit(EXIT_SUCCESS);
+	log_warnx("%s: io_uring multishot receive unsupported, using %s I/O",
+	    pc->pc_name, icmp_io_event.io_name);
+	event_del(ipd->ipd_uring->iu_ev);
+	ipd->ipd_io = &icmp_io_event;
+	if ((ipd->ipd_is4.is_sd != -1 &&
+	    icmp_event_attach(pc, &ipd->ipd_is4) == -1) ||
+	    (ipd->ipd_is6.is_sd != -1 &&
+	    icmp_event_attach(pc, &ipd->ipd_is6) == -1))
+		fatalx("%s: failed to attach the sockets", __FUNCTION__);
 }
 
-/* Create ICMP raw socket. */
-int
-icmp_socket(void)
+/* Receive completions handler, batched like the raw socket handler. */
+static void
+icmp_uring_handler(evutil_socket_t fd, short ev, void *arg)
 {
-	 int s;
+	struct proc_ctx *pc = arg;
+	struct icmp_probe_data *ipd = pc->pc_data;
+	struct icmp_uring *iu = ipd->ipd_uring;
+	struct io_uring_cqe *cqe;
+	struct icmp_sock *is;
+	uint64_t now, realnow;
+	uint16_t bid;
+	int batches, i, n, unsupported = 0;
 
-	 if ((s = socket(PF_INET, SOCK_RAW, IPPROTO_ICMP)) == -1)
-		 fatal("socket(PF_INET, SOCK_RAW, IPPROTO_ICMP)");
+	for (batches = 0; batches < ICMP_RECV_MAXBATCHES; batches++) {
+		/*
+		 * Bring in the completions that overflowed the queue, the
+		 * one ending the multishot receive may be among them.
+		 */
+		if (uring_submit(&iu->iu_rx, 0) == -1)
+			log_warn("%s: io_uring_enter", __FUNCTION__);
 
-	return (s);
+		n = 0;
+		while (n < ICMP_RECV_BATCH &&
+		    (cqe = uring_peek_cqe(&iu->iu_rx)) != NULL) {
+			is = icmp_sock_af(ipd, cqe->user_data);
+			if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+				is->is_armed = 0;
+
+			if (cqe->res < 0) {
+				/* Out of buffers, rearmed below. */
+				if (cqe->res == -EINVAL ||
+				    cqe->res == -EOPNOTSUPP)
+					unsupported = 1;
+				else if (cqe->res != -ENOBUFS)
+					log_warnx("%s: receive failed: %s",
+					    __FUNCTION__, strerror(-cqe->res));
+			} else if (cqe->flags & IORING_CQE_F_BUFFER) {
+				bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+				if (icmp_uring_unpack(ipd, n,
+				    uring_buf(&iu->iu_bufs, bid),
+				    cqe->res) == 0) {
+					iu->iu_bid[n] = bid;
+					iu->iu_is[n++] = is;
+				} else
+					uring_buf_recycle(&iu->iu_bufs, bid);
+			}
+
+			uring_cqe_seen(&iu->iu_rx);
+		}
+
+		now = mono_ns();
+		realnow = real_ns();
+		for (i = 0; i < n; i++) {
+			icmp_recv_slot(iu->iu_is[i], i, now, realnow);
+			uring_buf_recycle(&iu->iu_bufs, iu->iu_bid[i]);
+		}
+
+		if (n < ICMP_RECV_BATCH)
+			break;
+	}
+
+	if (unsupported) {
+		icmp_uring_fallback(pc);
+		return;
+	}
+
+	if ((ipd->ipd_is4.is_sd != -1 && ipd->ipd_is4.is_armed == 0 &&
+	    icmp_uring_arm(ipd, &ipd->ipd_is4) == -1) ||
+	    (ipd->ipd_is6.is_sd != -1 && ipd->ipd_is6.is_armed == 0 &&
+	    icmp_uring_arm(ipd, &ipd->ipd_is6) == -1))
+		fatalx("%s: failed to rearm the receive", __FUNCTION__);
 }
 
-/* Send ICMP packet. */
-int
-icmp_send(int sd, struct icmp_host *ih, struct proc_ctx *pc)
+static int
+icmp_uring_attach(struct proc_ctx *pc, struct icmp_sock *is)
 {
-	struct sockaddr *sa;
-	struct icmp_packet *ip;
-	ssize_t sent;
+	return (icmp_uring_arm(pc->pc_data, is));
+}
 
-	if ((ip = new_ip(ih, pc)) == NULL)
-		return (-1);
+/* Submit the `count` sends queued, wait for them and fail the errors. */
+static void
+icmp_uring_flush(struct icmp_probe_data *ipd, struct icmp_sock *is,
+    int count)
+{
+	struct icmp_uring *iu = ipd->ipd_uring;
+	struct io_uring_cqe *cqe;
+	struct icmp_host *ih;
+	int i, done;
+
+	if (count == 0)
+		return;
+
+	ipd->ipd_txsyscalls++;
+	if (uring_submit(&iu->iu_tx, count) == -1)
+		fatal("%s: io_uring_enter", __FUNCTION__);
+
+	for (done = 0; done < count; done++) {
+		if ((cqe = uring_peek_cqe(&iu->iu_tx)) == NULL)
+			fatalx("%s: missing send completions", __FUNCTION__);
+
+		i = cqe->user_data;
+		if (cqe->res < 0) {
+			ih = is->is_tih[i];
+			errno = -cqe->res;
+			log_warn("%s sendmsg to %s (%s) failed", __FUNCTION__,
+			    ih->ih_name, ih->ih_address);
+			is->is_tih[i] = NULL;
+			ipd->ipd_txerrors++;
+		}
 
-	sa = sstosa(&ih->ih_ss);
-	sent = sendto(sd, ip->ip_buf, 512, 0, sa, slen_sa(sa));
-	if (sent <= 0) {
-		log_warn("%s sendto failed", __FUNCTION__);
+		uring_cqe_seen(&iu->iu_tx);
+	}
+}
+
+/*
+ * Transmit the socket queue: one send per packet, all submitted and
+ * waited for with a single system call. MSG_DONTWAIT makes a full socket
+ * buffer fail the packet instead of stalling us.
+ */
+static void
+icmp_uring_send(struct icmp_probe_data *ipd, struct icmp_sock *is)
+{
+	struct icmp_uring *iu = ipd->ipd_uring;
+	struct io_uring_sqe *sqe;
+	int i, queued = 0;
+
+	for (i = 0; i < is->is_txcount; i++) {
+		/* The ring is as large as a batch, if full flush it first. */
+		if ((sqe = uring_get_sqe(&iu->iu_tx)) == NULL) {
+			icmp_uring_flush(ipd, is, queued);
+			queued = 0;
+			if ((sqe = uring_get_sqe(&iu->iu_tx)) == NULL)
+				fatalx("%s: no submission entry", __FUNCTION__);
+		}
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = is->is_sd;
+		sqe->addr = (uintptr_t) &is->is_tmsg[i].msg_hdr;
+		sqe->len = 1;
+		sqe->msg_flags = MSG_DONTWAIT;
+		sqe->user_data = i;
+		queued++;
+	}
+
+	icmp_uring_flush(ipd, is, queued);
+}
+
+static const struct icmp_io icmp_io_uring = {
+	.io_name = "io_uring",
+	.io_attach = icmp_uring_attach,
+	.io_send = icmp_uring_send,
+};
+
+/* Set up the rings, on failure the event backend is used instead. */
+static int
+icmp_uring_init(struct proc_ctx *pc)
+{
+	struct icmp_probe_data *ipd = pc->pc_data;
+	struct icmp_uring *iu;
+
+	if ((iu = calloc(1, sizeof(*iu))) == NULL) {
+		log_warn("%s", __FUNCTION__);
 		return (-1);
 	}
 
-	reschedule_icmp_send(ih);
+	if (uring_init(&iu->iu_tx, ICMP_SEND_BATCH, 0) == -1)
+		goto fail;
+	/*
+	 * Every buffer can complete a receive, plus the completion ending
+	 * the multishot receive of each socket when they run out.
+	 */
+	if (uring_init(&iu->iu_rx, 2, ICMP_URING_BUFS * 2) == -1)
+		goto fail_tx;
+	if (uring_bufring_init(&iu->iu_rx, &iu->iu_bufs, ICMP_URING_BUFS,
+	    ICMP_URING_BUFLEN, ICMP_URING_BGID) == -1)
+		goto fail_rx;
 
-	log_debug("Sent %s (%s) ICMP(id %d, seq %d) packet",
-	    ih->ih_name, ih->ih_address, ih->ih_id, ip->ip_seq);
+	iu->iu_msg.msg_namelen = sizeof(struct sockaddr_storage);
+	iu->iu_msg.msg_controllen = sizeof(ipd->ipd_rcmsg[0].buf);
 
+	iu->iu_ev = event_new(pc->pc_eb, iu->iu_rx.ur_fd, EV_READ | EV_PERSIST,
+	    icmp_uring_handler, pc);
+	if (iu->iu_ev == NULL || event_add(iu->iu_ev, NULL) == -1)
+		fatalx("%s: failed to add the ring event", __FUNCTION__);
+
+	ipd->ipd_uring = iu;
 	return (0);
+
+ fail_rx:
+	uring_close(&iu->iu_rx);
+ fail_tx:
+	uring_close(&iu->iu_tx);
+ fail:
+	free(iu);
+	return (-1);
 }
+#endif /* IO_URING_SUPPORT */
+
+#ifdef LINUX_SUPPORT
+/*
+ * PACKET_MMAP backend: replies are read in place from the packet socket
+ * ring, the raw socket is only used to send.
+ */
 
-/* Helper function to hide ping receive and parse. */
+/*
+ * Fill slot `i` of the receive batch with a packet of the ring, cut to
+ * the IP length (short frames carry link padding) and laid out like the
+ * raw sockets return it.
+ */
 static int
-icmp_parse(int sd, char *p, size_t plen, struct sockaddr_storage *ss,
-    struct ip **ip, struct icmp **icmp)
+icmp_packet_unpack(struct icmp_probe_data *ipd, int af, int i, char *p,
+    size_t len)
 {
-	size_t iplen;
-	size_t bytesread;
-	struct msghdr msg;
-	struct iovec iov[1];
-	struct sockaddr *sa;
-	union {
-		struct cmsghdr hdr;
-		char buf[CMSG_SPACE(1024)];
-	} cmsgbuf;
-
-	msg.msg_name = ss;
-	msg.msg_namelen = sizeof(*ss);
-	iov[0].iov_base = p;
-	iov[0].iov_len = plen;
-	msg.msg_iov = iov;
-	msg.msg_iovlen = NOF(sizeof(iov), sizeof(iov[0]));
-	msg.msg_control = &cmsgbuf.buf;
-	msg.msg_controllen = sizeof(cmsgbuf.buf);
-	if ((bytesread = recvmsg(sd, &msg, 0)) == -1)
-		fatal("recvmsg failed");
-
-	sa = msg.msg_name;
-	if (sa == NULL ||
-	    msg.msg_namelen < sizeof(struct sockaddr_in) ||
-	    (sa->sa_family != AF_INET /* && sa->sa_family != AF_INET6 */)) {
-		log_debug("unsupported family %d", sa->sa_family);
+	struct sockaddr_storage *ss = &ipd->ipd_rss[i];
+	struct ip *ip;
+	struct ip6_hdr *ip6;
+
+	memset(ss, 0, sizeof(*ss));
+	if (af == AF_INET6) {
+		ip6 = (struct ip6_hdr *) p;
+		if (len < sizeof(*ip6) ||
+		    ntohs(ip6->ip6_plen) > len - sizeof(*ip6))
+			return (-1);
+
+		ss->ss_family = AF_INET6;
+		sstosin6(ss)->sin6_addr = ip6->ip6_src;
+		ipd->ipd_rsslen[i] = sizeof(struct sockaddr_in6);
+		ipd->ipd_rdata[i] = p + sizeof(*ip6);
+		ipd->ipd_rlen[i] = ntohs(ip6->ip6_plen);
+		return (0);
+	}
+
+	ip = (struct ip *) p;
+	if (len < sizeof(*ip) || ntohs(ip->ip_len) > len)
 		return (-1);
+
+	ss->ss_family = AF_INET;
+	sstosin(ss)->sin_addr = ip->ip_src;
+	ipd->ipd_rsslen[i] = sizeof(struct sockaddr_in);
+	ipd->ipd_rdata[i] = p;
+	ipd->ipd_rlen[i] = ntohs(ip->ip_len);
+	return (0);
+}
+
+/* Handle all the packets of a ring block. */
+static void
+icmp_packet_block(struct icmp_sock *is, struct tpacket_block_desc *bd)
+{
+	struct icmp_probe_data *ipd = is->is_pc->pc_data;
+	struct tpacket3_hdr *tp;
+	uint64_t now, realnow;
+	uint32_t n;
+
+	now = mono_ns();
+	realnow = real_ns();
+	tp = (struct tpacket3_hdr *) ((char *) bd +
+	    bd->hdr.bh1.offset_to_first_pkt);
+	for (n = 0; n < bd->hdr.bh1.num_pkts; n++) {
+		/* One slot is enough, packets are handled one by one. */
+		if (tp->tp_snaplen == tp->tp_len &&
+		    icmp_packet_unpack(ipd, is->is_af, 0,
+		    (char *) tp + tp->tp_net, tp->tp_snaplen) == 0) {
+			ipd->ipd_rts[0] = (uint64_t) tp->tp_sec * 1000000000ULL +
+			    tp->tp_nsec;
+			icmp_recv_slot(is, 0, now, realnow);
+		}
+
+		tp = (struct tpacket3_hdr *) ((char *) tp + tp->tp_next_offset);
 	}
+}
 
-	/* TODO IPv6 */
-	*ip = (struct ip *) p;
-	iplen = (*ip)->ip_hl << 2;
-	if (bytesread < (iplen + ICMP_MINLEN)) {
-		log_debug("packet too small");
+/*
+ * Packet socket handler: walk the blocks the kernel retired to us and
+ * give them back. The event loop runs again after ICMP_RECV_MAXBATCHES
+ * blocks, like with the raw socket.
+ */
+static void
+icmp_packet_handler(evutil_socket_t sd, short ev, void *arg)
+{
+	struct icmp_sock *is = arg;
+	struct tpacket_block_desc *bd;
+	int blocks;
+
+	for (blocks = 0; blocks < ICMP_RECV_MAXBATCHES; blocks++) {
+		bd = (struct tpacket_block_desc *) (is->is_ring +
+		    (size_t) is->is_ringblock * ICMP_PKT_BLOCKSIZE);
+		if ((__atomic_load_n(&bd->hdr.bh1.block_status,
+		    __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0)
+			break;
+
+		icmp_packet_block(is, bd);
+
+		__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+		    __ATOMIC_RELEASE);
+		is->is_ringblock = (is->is_ringblock + 1) % ICMP_PKT_BLOCKNR;
+	}
+}
+
+/* Map the ring of the packet socket we got and start reading it. */
+static int
+icmp_packet_open(struct proc_ctx *pc, struct icmp_sock *is, int sd)
+{
+	void *ring;
+
+	ring = mmap(NULL, (size_t) ICMP_PKT_BLOCKSIZE * ICMP_PKT_BLOCKNR,
+	    PROT_READ | PROT_WRITE, MAP_SHARED, sd, 0);
+	if (ring == MAP_FAILED) {
+		log_warn("%s: mmap", __FUNCTION__);
 		return (-1);
 	}
 
-	*icmp = (struct icmp *) (p + iplen);
+	is->is_pktsd = sd;
+	is->is_ring = ring;
+	is->is_ringblock = 0;
+	is->is_pktev = event_new(pc->pc_eb, sd, EV_READ | EV_PERSIST,
+	    icmp_packet_handler, is);
+	if (is->is_pktev == NULL)
+		return (-1);
 
-	return (0);
+	return (event_add(is->is_pktev, NULL));
+}
+
+/* The raw socket only sends, ask for the packet socket to receive. */
+static int
+icmp_packet_attach(struct proc_ctx *pc, struct icmp_sock *is)
+{
+	return (compose_to_father(pc, IMSG_SOCKET_PACKET, &is->is_af,
+	    sizeof(is->is_af)));
+}
+
+static const struct icmp_io icmp_io_packet = {
+	.io_name = "packet",
+	.io_attach = icmp_packet_attach,
+	.io_send = icmp_event_send,
+};
+#endif /* LINUX_SUPPORT */
+
+#ifdef XDP_SUPPORT
+/*
+ * XDP backend: the echo replies arriving on the XDP interface are steered
+ * to an AF_XDP socket the parent set up before forking, and read in place
+ * from its ring without system calls. Replies from other interfaces and
+ * the ICMP errors still come through the raw socket.
+ */
+static struct xdp_sock icmp_xsk;
+
+int
+icmp_xdp_open(void)
+{
+	return (xdp_open(&icmp_xsk, sc.sc_xdp_ifname, sc.sc_xdp_queue,
+	    sc.sc_icmp_idbase, 1));
 }
 
-/* Raw socket handler. */
 static void
-icmp_raw_socket_handler(evutil_socket_t sd, short ev, void *arg)
+icmp_xdp_handler(evutil_socket_t sd, short ev, void *arg)
 {
 	struct proc_ctx *pc = arg;
 	struct icmp_probe_data *ipd = pc->pc_data;
-	struct ip *ip;
-	struct icmp *icmp;
-	struct icmp_host *ih;
-	struct icmp_packet *ipkt;
-	struct sockaddr_storage ss;
-	char buf[1536];
+	struct ethhdr *eth;
+	char *frame;
+	uint64_t now, realnow, addr;
+	uint32_t len;
+	int af, n;
 
-	if (icmp_parse(ipd->ipd_sd, buf, sizeof(buf), &ss, &ip, &icmp))
-		return;
+	now = mono_ns();
+	realnow = real_ns();
+	for (n = 0; n < ICMP_RECV_BATCH * ICMP_RECV_MAXBATCHES; n++) {
+		if ((frame = xdp_recv(&icmp_xsk, &len, &addr)) == NULL)
+			break;
 
-	if ((ih = find_ih(icmp->icmp_id)) == NULL) {
-		log_debug("received ICMP packet, but it's not for us");
-		return;
-	}
+		/* One slot is enough, frames are handled one by one. */
+		eth = (struct ethhdr *) frame;
+		af = (eth->h_proto == htons(ETH_P_IPV6)) ? AF_INET6 : AF_INET;
+		if (len > sizeof(*eth) && icmp_packet_unpack(ipd, af, 0,
+		    frame + sizeof(*eth), len - sizeof(*eth)) == 0) {
+			ipd->ipd_rts[0] = 0;
+			icmp_recv_slot(icmp_sock_af(ipd, af), 0, now, realnow);
+		}
 
-	if (icmp->icmp_type != ICMP_ECHOREPLY) {
-		/* TODO handle unreachable */
-		log_debug("received ICMP type %d", icmp->icmp_type);
-		return;
+		xdp_refill(&icmp_xsk, addr);
 	}
+	xdp_sync(&icmp_xsk);
+}
+
+static int
+icmp_xdp_init(struct proc_ctx *pc)
+{
+	struct event *ev;
+
+	ev = event_new(pc->pc_eb, icmp_xsk.xs_fd, EV_READ | EV_PERSIST,
+	    icmp_xdp_handler, pc);
+	if (ev == NULL)
+		return (-1);
+
+	return (event_add(ev, NULL));
+}
+
+static void
+icmp_xdp_drops(struct proc_ctx *pc)
+{
+	uint64_t drops;
+
+	if (xdp_drops(&icmp_xsk, &drops) == 0)
+		log_info("%s: XDP socket: %llu packets dropped, ring full",
+		    pc->pc_name, (unsigned long long) drops);
+}
+
+static const struct icmp_io icmp_io_xdp = {
+	.io_name = "xdp",
+	.io_attach = icmp_event_attach,
+	.io_send = icmp_event_send,
+	.io_drops = icmp_xdp_drops,
+};
+#endif /* XDP_SUPPORT */
+
+/* Ask the parent for the socket of the address family, once. */
+static void
+icmp_sock_request(struct proc_ctx *pc, int af)
+{
+	struct icmp_sock *is = icmp_sock_af(pc->pc_data, af);
 
-	icmp->icmp_seq = ntohs(icmp->icmp_seq);
-	if ((ipkt = find_ip(ih, icmp->icmp_seq)) == NULL) {
-		log_debug("received out-of-sequence packet: %d",
-		    icmp->icmp_seq);
+	if (is->is_requested)
 		return;
-	}
 
-	if (ih->ih_ihs == IHS_DOWN) {
-		log_debug("%s (%s) is up", ih->ih_name, ih->ih_address);
-		ih->ih_ihs = IHS_UP;
-		compose_to_father(pc, IMSG_HOST_UP, ih, sizeof(*ih));
+	is->is_requested = 1;
+	compose_to_father(pc, IMSG_SOCKET_RAW, &af, sizeof(af));
+}
+
+/*
+ * Point a host at its newly resolved address. Probes in flight to the
+ * old address are dropped: the cookie covers the address, so their
+ * replies would be rejected anyway.
+ */
+static int
+ih_retarget(struct icmp_host *ih, struct sockaddr_storage *ss)
+{
+	struct proc_ctx *pc = ih->ih_pc;
+	struct icmp_probe_data *ipd = pc->pc_data;
+	struct icmp_sock *is;
+	int oaf = ih->ih_ss.ss_family;
+
+	if (ss->ss_family != AF_INET && ss->ss_family != AF_INET6) {
+		log_warnx("%s: invalid address family %d for %s",
+		    __FUNCTION__, ss->ss_family, ih->ih_name);
+		return (-1);
 	}
+	if (ih_address_cmp(&ih->ih_ss, ss) == 0)
+		return (-1);
 
-	ih->ih_retrycount = IH_DEF_RETRYCOUNT;
+	/* The transmit queue still points at the old address. */
+	icmp_send_flush(ipd);
+	free_ip_all(ih);
 
-	/* Reschedule ICMP packet. */
-	reschedule_icmp_send(ih);
+	memcpy(&ih->ih_ss, ss, sizeof(ih->ih_ss));
+	ih_tmpl_init(ih);
+	log_debug("%s: %s (%s) retargeted", __FUNCTION__, ih->ih_name,
+	    ih->ih_address);
+
+	/* Same family, the schedule carries on. */
+	if (oaf == ss->ss_family)
+		return (0);
+
+	tw_del(&ih->ih_twe);
+	is = icmp_sock_af(ipd, ss->ss_family);
+	if (is->is_sd != -1)
+		ih_schedule(ih, ih->ih_timing.it_interval, 0);
+	else
+		icmp_sock_request(pc, ss->ss_family);
 
-	free_ip(ih, ipkt);
+	return (0);
 }
 
 /* Main event dispatcher. */
@@ -175,9 +2037,11 @@ icmp_main_dispatcher(evutil_socket_t sd, short ev, void *arg)
 {
 	struct proc_ctx *pc = arg;
 	struct icmp_probe_data *ipd = pc->pc_data;
+	struct icmp_sock *is;
 	struct icmp_host *ih;
+	struct icmp_host_address iha;
 	struct imsg imsg;
-	int n;
+	int n, af, retargeted = 0;
 
 	if (imsg_read(&pc->pc_ibuf) == -1 && errno != EAGAIN)
 		fatal("%s: imsg_read", __FUNCTION__);
@@ -190,12 +2054,50 @@ icmp_main_dispatcher(evutil_socket_t sd, short ev, void *arg)
 
 		switch (imsg.hdr.type) {
 		case IMSG_SOCKET_RAW:
-			ipd->ipd_sd = imsg.fd;
-			ipd->ipd_sdev = event_new(pc->pc_eb, ipd->ipd_sd,
-			    EV_READ | EV_PERSIST, icmp_raw_socket_handler, pc);
-			event_add(ipd->ipd_sdev, NULL);
-			TAILQ_FOREACH(ih, &sc.sc_ihlist, ih_entry)
-				icmp_send(ipd->ipd_sd, ih, pc);
+			if ((imsg.hdr.len - IMSG_HEADER_SIZE) != sizeof(af))
+				fatalx("%s: invalid socket message", __FUNCTION__);
+
+			memcpy(&af, imsg.data, sizeof(af));
+			is = icmp_sock_af(ipd, af);
+			is->is_sd = imsg.fd;
+			if (ipd->ipd_io->io_attach(pc, is) == -1)
+				fatalx("%s: failed to attach the %s socket",
+				    __FUNCTION__, ipd->ipd_io->io_name);
+			/* Start probing, spread over the first interval. */
+			TAILQ_FOREACH(ih, &sc.sc_ihlist, ih_entry) {
+				if (ih->ih_ss.ss_family == af)
+					ih_schedule(ih,
+					    ih->ih_timing.it_interval, 0);
+			}
+			break;
+
+#ifdef LINUX_SUPPORT
+		case IMSG_SOCKET_PACKET:
+			if ((imsg.hdr.len - IMSG_HEADER_SIZE) != sizeof(af))
+				fatalx("%s: invalid socket message", __FUNCTION__);
+
+			memcpy(&af, imsg.data, sizeof(af));
+			if (imsg.fd == -1 ||
+			    icmp_packet_open(pc, icmp_sock_af(ipd, af),
+			    imsg.fd) == -1)
+				fatalx("%s: failed to open the packet ring",
+				    __FUNCTION__);
+			break;
+#endif /* LINUX_SUPPORT */
+
+		case IMSG_HOST_ADDRESS:
+			if ((imsg.hdr.len - IMSG_HEADER_SIZE) != sizeof(iha))
+				fatalx("%s: invalid address message",
+				    __FUNCTION__);
+
+			memcpy(&iha, imsg.data, sizeof(iha));
+			if ((ih = find_ih(iha.iha_index)) == NULL) {
+				log_warnx("%s: address for unknown host %u",
+				    __FUNCTION__, iha.iha_index);
+				break;
+			}
+			if (ih_retarget(ih, &iha.iha_ss) == 0)
+				retargeted = 1;
 			break;
 
 		default:
@@ -203,70 +2105,85 @@ icmp_main_dispatcher(evutil_socket_t sd, short ev, void *arg)
 			    imsg.hdr.type);
 			break;
 		}
+
+		imsg_free(&imsg);
 	}
+
+	/* Rebuild the address table once for all the new addresses. */
+	if (retargeted && ih_addr_table_init() == -1)
+		fatalx("failed to rebuild ICMP host address table");
 }
 
-/* Handle ICMP host timeouts. */
-static void
-ih_timeout(evutil_socket_t bula, short ev, void *arg)
+/* Handle ICMP host timeouts, returns -1 if no probe was sent. */
+static int
+ih_timeout(struct icmp_host *ih)
 {
-	struct icmp_host *ih = arg;
 	struct proc_ctx *pc = ih->ih_pc;
-	struct icmp_probe_data *ipd = pc->pc_data;
-	struct icmp_packet *ip, *ipn;
 
 	if (ih->ih_ihs == IHS_UP &&
 	    ih->ih_retrycount == 0) {
-		log_debug("%s (%s) is down", ih->ih_name, ih->ih_address);
-		ih->ih_ihs = IHS_DOWN;
+		ih_down(ih);
+		return (-1);
+	}
 
-		compose_to_father(pc, IMSG_HOST_DOWN, ih, sizeof(*ih));
+	if (ih->ih_retrycount)
+		ih->ih_retrycount--;
 
-		/* Don't bother expecting response from a down host. */
-		TAILQ_FOREACH_SAFE(ip, &ih->ih_iplist, ip_entry, ipn)
-			free_ip(ih, ip);
+	return (icmp_send(ih, pc));
+}
 
-		/* Host just went down, reschedule it for later. */
-		reschedule_icmp_send(ih);
-		return;
+/*
+ * Timer wheel tick: run every expired host and hand all the resulting
+ * probes to the send path at once. Hosts over the pacer budget wait for
+ * the next tick.
+ */
+static void
+icmp_tick_handler(evutil_socket_t bula, short ev, void *arg)
+{
+	struct proc_ctx *pc = arg;
+	struct icmp_probe_data *ipd = pc->pc_data;
+	struct tw_list expired;
+	struct tw_entry *twe;
+
+	LIST_INIT(&expired);
+	tw_expire(&ipd->ipd_tw, &expired);
+	icmp_pace_refill(ipd);
+	while ((twe = LIST_FIRST(&expired)) != NULL) {
+		LIST_REMOVE(twe, twe_entry);
+		if (icmp_pace_take(ipd) == 0) {
+			ipd->ipd_txdeferred++;
+			tw_add(&ipd->ipd_tw, twe, TW_TICK_MS);
+			continue;
+		}
+
+		if (ih_timeout(twe->twe_arg) == -1)
+			icmp_pace_give(ipd);
 	}
 
-	if (ih->ih_retrycount)
-		ih->ih_retrycount--;
+	icmp_send_flush(ipd);
 
-	icmp_send(ipd->ipd_sd, ih, pc);
+	/* Host events waiting for the parent to catch up. */
+	if (!TAILQ_EMPTY(&ipd->ipd_ihelist))
+		event_active(ipd->ipd_reportev, EV_TIMEOUT, 1);
 }
 
 /* Initialize ICMP host. */
 static int
 init_ih(struct icmp_host *ih, struct proc_ctx *pc)
 {
-	/* TODO handle resolving DNS */
-	if (inet_pton(AF_INET, ih->ih_address,
-	    &sstosin(&ih->ih_ss)->sin_addr.s_addr) != 1) {
-		if (inet_pton(AF_INET6, ih->ih_address,
-		    &sstosin6(&ih->ih_ss)->sin6_addr) != 1) {
-			fatal("unable to translate %s", ih->ih_address);
-			TAILQ_REMOVE(&sc.sc_ihlist, ih, ih_entry);
-			free(ih);
-			return (-1);
-		} else {
-			ih->ih_ss.ss_family = AF_INET6;
-#ifndef LINUX_SUPPORT
-			/* Linux doesn't have *_len on sockaddr structures. */
-			ih->ih_ss.ss_len = sizeof(struct sockaddr_in6);
-#endif /* LINUX_SUPPORT */
-		}
-	} else {
-		ih->ih_ss.ss_family = AF_INET;
-#ifndef LINUX_SUPPORT
-		/* Linux doesn't have *_len on sockaddr structures. */
-		ih->ih_ss.ss_len = sizeof(struct sockaddr_in);
-#endif /* LINUX_SUPPORT */
-	}
+	struct icmp_probe_data *ipd = pc->pc_data;
+
+	/* Names are resolved by the parent, wait for the address. */
+	if (ih_address_parse(ih->ih_address, &ih->ih_ss) == -1)
+		log_debug("%s: waiting for %s to be resolved", __FUNCTION__,
+		    ih->ih_address);
+
 	ih->ih_pc = pc;
-	ih->ih_to = evtimer_new(pc->pc_eb, ih_timeout, ih);
-	ih->ih_retrycount = IH_DEF_RETRYCOUNT;
+	ih->ih_id = ipd->ipd_id;
+	ih_tmpl_init(ih);
+	tw_entry_init(&ih->ih_twe, ih);
+	ih->ih_retrycount = ih->ih_timing.it_retry;
+	ih->ih_loss.ls_size = loss_window_len();
 	return (0);
 }
 
@@ -277,14 +2194,35 @@ icmp_handler(struct proc_ctx *pc)
 	struct event_base *eb = event_base_new();
 	struct icmp_probe_data *ipd;
 	struct icmp_host *ih, *ihn;
-	struct event *evsig_term, *evsig_int;
+	struct event *evsig_term, *evsig_int, *evsig_usr1;
+	struct timeval tick = { 0, TW_TICK_MS * 1000 };
 
 	/* Initialize icmp probe private data. */
 	if ((pc->pc_data = calloc(1, sizeof(*ipd))) == NULL)
 		fatal("%s", __FUNCTION__);
 
 	ipd = pc->pc_data;
-	ipd->ipd_sd = -1;
+	ipd->ipd_is4.is_pc = pc;
+	ipd->ipd_is4.is_af = AF_INET;
+	ipd->ipd_is4.is_sd = -1;
+#ifdef LINUX_SUPPORT
+	ipd->ipd_is4.is_pktsd = -1;
+#endif /* LINUX_SUPPORT */
+	ipd->ipd_is6.is_pc = pc;
+	ipd->ipd_is6.is_af = AF_INET6;
+	ipd->ipd_is6.is_sd = -1;
+#ifdef LINUX_SUPPORT
+	ipd->ipd_is6.is_pktsd = -1;
+#endif /* LINUX_SUPPORT */
+	icmp_shard(pc->pc_instance, &ipd->ipd_first, &ipd->ipd_count);
+	ipd->ipd_id = sc.sc_icmp_idbase + pc->pc_instance;
+	/* Split icmp-pps like the hosts, so the shares add up exactly. */
+	ipd->ipd_pps =
+	    (uint64_t) sc.sc_icmp_pps * (pc->pc_instance + 1) /
+	    sc.sc_icmp_workers -
+	    (uint64_t) sc.sc_icmp_pps * pc->pc_instance / sc.sc_icmp_workers;
+	ipd->ipd_tokens_ts = mono_ns();
+	ipd->ipd_io = &icmp_io_event;
 
 	/* Install signal handlers */
 	signal(SIGPIPE, SIG_IGN);
@@ -292,14 +2230,54 @@ icmp_handler(struct proc_ctx *pc)
 	signal(SIGCHLD, SIG_IGN);
 	evsig_term = evsignal_new(eb, SIGTERM, icmp_handle_term, NULL);
 	evsig_int = evsignal_new(eb, SIGINT, icmp_handle_term, NULL);
+	evsig_usr1 = evsignal_new(eb, SIGUSR1, icmp_handle_usr1, pc);
 	evsignal_add(evsig_term, NULL);
 	evsignal_add(evsig_int, NULL);
+	evsignal_add(evsig_usr1, NULL);
 
 	/* Register main process handler */
 	pc_add(eb, pc, pc->pc_sp[1], icmp_main_dispatcher);
 
-	/* Initialize probes. */
+#ifdef LINUX_SUPPORT
+	if (sc.sc_icmp_io == ICMP_IO_PACKET)
+		ipd->ipd_io = &icmp_io_packet;
+#endif /* LINUX_SUPPORT */
+#ifdef IO_URING_SUPPORT
+	if (sc.sc_icmp_io == ICMP_IO_URING) {
+		if (icmp_uring_init(pc) == 0)
+			ipd->ipd_io = &icmp_io_uring;
+		else
+			log_warnx("%s: io_uring unavailable, using %s I/O",
+			    pc->pc_name, ipd->ipd_io->io_name);
+	}
+#endif /* IO_URING_SUPPORT */
+#ifdef XDP_SUPPORT
+	if (sc.sc_icmp_io == ICMP_IO_XDP) {
+		if (icmp_xdp_init(pc) == -1)
+			fatalx("%s: failed to read the XDP socket", pc->pc_name);
+		ipd->ipd_io = &icmp_io_xdp;
+	}
+#endif /* XDP_SUPPORT */
+
+	/* Register the transmit queue flusher. */
+	ipd->ipd_txev = event_new(eb, -1, 0, icmp_send_handler, pc);
+
+	/* Register the results flusher. */
+	ipd->ipd_reportev = event_new(eb, -1, 0, icmp_report_handler, pc);
+	TAILQ_INIT(&ipd->ipd_ihelist);
+
+	/* Start the probe timer wheel. */
+	tw_init(&ipd->ipd_tw);
+	ipd->ipd_twev = event_new(eb, -1, EV_PERSIST, icmp_tick_handler, pc);
+	evtimer_add(ipd->ipd_twev, &tick);
+
+	/* Initialize probes, forget the ones other workers are handling. */
 	TAILQ_FOREACH_SAFE(ih, &sc.sc_ihlist, ih_entry, ihn) {
+		if ((ih->ih_index - ipd->ipd_first) >= ipd->ipd_count) {
+			TAILQ_REMOVE(&sc.sc_ihlist, ih, ih_entry);
+			continue;
+		}
+
 		if (init_ih(ih, pc))
 			continue;
 
@@ -307,8 +2285,17 @@ icmp_handler(struct proc_ctx *pc)
 		    ih->ih_name, ih->ih_address);
 	}
 
-	/* Ask for a raw socket. */
-	compose_to_father(pc, IMSG_SOCKET_RAW, NULL, 0);
+	if (ih_table_init(ipd->ipd_first, ipd->ipd_count) == -1 ||
+	    ih_addr_table_init() == -1)
+		fatalx("failed to build ICMP host table");
+	if (!sc.sc_icmp_stateless && ih_ipring_init() == -1)
+		fatalx("failed to allocate in-flight packet slots");
+
+	/* Ask for a raw socket for each address family in use. */
+	TAILQ_FOREACH(ih, &sc.sc_ihlist, ih_entry) {
+		if (ih->ih_ss.ss_family != AF_UNSPEC)
+			icmp_sock_request(pc, ih->ih_ss.ss_family);
+	}
 
 	event_base_dispatch(eb);
 	/* NOTREACHED */
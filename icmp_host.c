@@ -14,10 +14,13 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <math.h>
 #include <stdlib.h>
 
 #include "serverstatd.h"
 
+static uint32_t icmp_host_db_id(const char *);
+
 /* Log address */
 void
 log_sa(struct sockaddr *sa)
@@ -64,7 +67,7 @@ slen_sa(struct sockaddr *sa)
 
 /* New icmp host */
 struct icmp_host *
-new_ih(uint16_t id)
+new_ih(uint32_t index)
 {
 	struct icmp_host *ih;
 
@@ -73,56 +76,355 @@ new_ih(uint16_t id)
 		return (NULL);
 	}
 
-	ih->ih_id = id;
+	ih->ih_index = index;
 	return (ih);
 }
 
+/*
+ * Translate a literal IPv4 or IPv6 address. Anything else is a name the
+ * parent has to resolve for us.
+ */
+int
+ih_address_parse(const char *address, struct sockaddr_storage *ss)
+{
+	memset(ss, 0, sizeof(*ss));
+	if (inet_pton(AF_INET, address, &sstosin(ss)->sin_addr) == 1) {
+		ss->ss_family = AF_INET;
+#ifndef LINUX_SUPPORT
+		/* Linux doesn't have *_len on sockaddr structures. */
+		ss->ss_len = sizeof(struct sockaddr_in);
+#endif /* LINUX_SUPPORT */
+		return (0);
+	}
+
+	if (inet_pton(AF_INET6, address, &sstosin6(ss)->sin6_addr) == 1) {
+		ss->ss_family = AF_INET6;
+#ifndef LINUX_SUPPORT
+		ss->ss_len = sizeof(struct sockaddr_in6);
+#endif /* LINUX_SUPPORT */
+		return (0);
+	}
+
+	ss->ss_family = AF_UNSPEC;
+	return (-1);
+}
+
+/* Compare the addresses of two sockaddrs, ports are ignored. */
+int
+ih_address_cmp(struct sockaddr_storage *a, struct sockaddr_storage *b)
+{
+	if (a->ss_family != b->ss_family)
+		return (1);
+
+	switch (a->ss_family) {
+	case AF_INET:
+		return (memcmp(&sstosin(a)->sin_addr, &sstosin(b)->sin_addr,
+		    sizeof(struct in_addr)));
+	case AF_INET6:
+		return (memcmp(&sstosin6(a)->sin6_addr,
+		    &sstosin6(b)->sin6_addr, sizeof(struct in6_addr)));
+	default:
+		return (0);
+	}
+}
+
+/*
+ * Host index to host lookup table, covering the indexes from `ihfirst`
+ * up to `ihfirst + ihcount` this worker is handling.
+ */
+static struct icmp_host **ihtable;
+static uint32_t ihfirst;
+static uint32_t ihcount;
+
+/* Build the ICMP host lookup table from the configured hosts. */
+int
+ih_table_init(uint32_t first, uint32_t count)
+{
+	struct icmp_host *ih;
+
+	free(ihtable);
+	if ((ihtable = calloc(MAX(count, 1), sizeof(*ihtable))) == NULL) {
+		log_warn("%s", __FUNCTION__);
+		return (-1);
+	}
+	ihfirst = first;
+	ihcount = count;
+
+	TAILQ_FOREACH(ih, &sc.sc_ihlist, ih_entry) {
+		if ((ih->ih_index - ihfirst) >= ihcount) {
+			log_warnx("%s: host index %u out of range",
+			    __FUNCTION__, ih->ih_index);
+			return (-1);
+		}
+		ihtable[ih->ih_index - ihfirst] = ih;
+	}
+
+	return (0);
+}
+
 /* Lookup ICMP host. */
 struct icmp_host *
-find_ih(uint16_t id)
+find_ih(uint32_t index)
+{
+	if (ihtable == NULL || (index - ihfirst) >= ihcount)
+		return (NULL);
+
+	return (ihtable[index - ihfirst]);
+}
+
+/*
+ * Address to host lookup table, for ICMP errors that don't quote enough
+ * of our probe to carry its identity.
+ *
+ * Open addressing with linear probing, the table size is kept at least
+ * twice the number of hosts so probe sequences stay short. Hosts sharing
+ * an address are found in configuration order.
+ */
+static struct icmp_host **ihatable;
+static size_t ihatable_mask;
+
+/* Address of the host in network byte order and its length. */
+static const void *
+ih_addr(struct icmp_host *ih, int *af, size_t *len)
+{
+	*af = ih->ih_ss.ss_family;
+	if (*af == AF_INET6) {
+		*len = sizeof(struct in6_addr);
+		return (&sstosin6(&ih->ih_ss)->sin6_addr);
+	}
+
+	*len = sizeof(struct in_addr);
+	return (&sstosin(&ih->ih_ss)->sin_addr);
+}
+
+static inline size_t
+ih_addr_hash(const void *addr, size_t len)
+{
+	const uint8_t *p = addr;
+	uint32_t word, hash = 0;
+	size_t i;
+
+	for (i = 0; i < len; i += sizeof(word)) {
+		memcpy(&word, &p[i], sizeof(word));
+		hash = (hash ^ word) * 2654435761U;
+	}
+
+	/*
+	 * The multiply only carries upwards and the last octet of an address,
+	 * the one that differs inside a subnet, is loaded into the top byte:
+	 * fold the high bits down (MurmurHash3 finalizer) or a whole /24 would
+	 * land on the same slot.
+	 */
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bU;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35U;
+	hash ^= hash >> 16;
+
+	return (hash);
+}
+
+/* Build the address lookup table from the configured hosts. */
+int
+ih_addr_table_init(void)
 {
 	struct icmp_host *ih;
+	const void *addr;
+	size_t count = 0, size, slot, len;
+	int af;
 
-	TAILQ_FOREACH(ih, &sc.sc_ihlist, ih_entry) {
-		if (ih->ih_id != id)
-			continue;
+	TAILQ_FOREACH(ih, &sc.sc_ihlist, ih_entry)
+		count++;
+
+	for (size = 16; size < (count * 2); size <<= 1)
+		/* NOTHING */;
+
+	free(ihatable);
+	if ((ihatable = calloc(size, sizeof(*ihatable))) == NULL) {
+		log_warn("%s", __FUNCTION__);
+		return (-1);
+	}
+	ihatable_mask = size - 1;
+
+	/* The list is in reverse configuration order. */
+	TAILQ_FOREACH_REVERSE(ih, &sc.sc_ihlist, ih_list, ih_entry) {
+		addr = ih_addr(ih, &af, &len);
+		slot = ih_addr_hash(addr, len) & ihatable_mask;
+		while (ihatable[slot] != NULL)
+			slot = (slot + 1) & ihatable_mask;
+		ihatable[slot] = ih;
+	}
+
+	return (0);
+}
 
-		return (ih);
+/* Lookup ICMP host by address. */
+struct icmp_host *
+find_ih_addr(int af, const void *addr)
+{
+	struct icmp_host *ih;
+	const void *ihaddr;
+	size_t slot, len, ihlen;
+	int ihaf;
+
+	if (ihatable == NULL)
+		return (NULL);
+
+	len = (af == AF_INET6) ? sizeof(struct in6_addr) :
+	    sizeof(struct in_addr);
+	slot = ih_addr_hash(addr, len) & ihatable_mask;
+	while ((ih = ihatable[slot]) != NULL) {
+		ihaddr = ih_addr(ih, &ihaf, &ihlen);
+		if (ihaf == af && memcmp(ihaddr, addr, len) == 0)
+			return (ih);
+
+		slot = (slot + 1) & ihatable_mask;
 	}
 
 	return (NULL);
 }
 
-/* Generate ICMP packet. */
-struct icmp_packet *
-new_ip(struct icmp_host *ih, struct proc_ctx *pc)
+/*
+ * Allocate the in-flight packet rings of all hosts from a single slab.
+ *
+ * Slots are reused in place, so probing never allocates memory and each
+ * host is bounded to IH_IPSLOTS outstanding packets.
+ */
+int
+ih_ipring_init(void)
 {
-	struct icmp_packet *ip;
-	struct icmp *icmp;
-	char *ptr;
+	struct icmp_host *ih;
+	struct icmp_packet *slab;
+	size_t count = 0;
 
-	if ((ip = calloc(1, sizeof(*ip))) == NULL) {
+	TAILQ_FOREACH(ih, &sc.sc_ihlist, ih_entry)
+		count++;
+
+	if (count == 0)
+		return (0);
+
+	if ((slab = calloc(count * IH_IPSLOTS, sizeof(*slab))) == NULL) {
 		log_warn("%s", __FUNCTION__);
-		return (NULL);
+		return (-1);
 	}
 
-	TAILQ_INSERT_HEAD(&ih->ih_iplist, ip, ip_entry);
-	ih->ih_ipcount++;
+	TAILQ_FOREACH(ih, &sc.sc_ihlist, ih_entry) {
+		ih->ih_ipring = slab;
+		slab += IH_IPSLOTS;
+	}
 
-	ip->ip_seq = ih->ih_seq++;
-	event_base_gettimeofday_cached(pc->pc_eb, &ip->ip_tv);
+	return (0);
+}
 
-	ptr = ip->ip_buf;
-	icmp = (struct icmp *) ptr;
-	icmp->icmp_type = ICMP_ECHO;
+/*
+ * Compute the host cookie: a keyed hash of the index and the address,
+ * so a reply is only accepted for the host it was sent to.
+ */
+static uint32_t
+ih_cookie(struct icmp_host *ih)
+{
+	uint8_t buf[sizeof(uint32_t) + sizeof(struct in6_addr)];
+	uint32_t index = htonl(ih->ih_index);
+	size_t len = sizeof(index);
+
+	memcpy(buf, &index, sizeof(index));
+	if (ih->ih_ss.ss_family == AF_INET6) {
+		memcpy(&buf[len], &sstosin6(&ih->ih_ss)->sin6_addr,
+		    sizeof(struct in6_addr));
+		len += sizeof(struct in6_addr);
+	} else {
+		memcpy(&buf[len], &sstosin(&ih->ih_ss)->sin_addr,
+		    sizeof(struct in_addr));
+		len += sizeof(struct in_addr);
+	}
+
+	return ((uint32_t) siphash24(sc.sc_icmp_key, buf, len));
+}
+
+/*
+ * Build the host echo request template.
+ *
+ * The payload carries the probe identity, because datagram ICMP sockets
+ * replace the header id with their own. The rest of the payload is all
+ * zeroes, so it doesn't change the checksum and only the template needs
+ * to be summed.
+ */
+void
+ih_tmpl_init(struct icmp_host *ih)
+{
+	struct icmp *icmp = (struct icmp *) ih->ih_tmpl;
+	struct ih_payload ihp;
+
+	/* The cookie is a per probe MAC, see new_ip(). */
+	ih->ih_cookie = ih_cookie(ih);
+	memset(&ihp, 0, sizeof(ihp));
+	ihp.ihp_index = htonl(ih->ih_index);
+
+	memset(ih->ih_tmpl, 0, sizeof(ih->ih_tmpl));
 	icmp->icmp_code = 0;
 	icmp->icmp_cksum = 0;
-	icmp->icmp_seq = htons(ip->ip_seq);
-	icmp->icmp_id = ih->ih_id;
+	icmp->icmp_seq = 0;
+	icmp->icmp_id = htons(ih->ih_id);
+	memcpy(&ih->ih_tmpl[ICMP_MINLEN], &ihp, sizeof(ihp));
+
+	/* The kernel computes ICMPv6 checksums, it needs the addresses. */
+	if (ih->ih_ss.ss_family == AF_INET6) {
+		icmp->icmp_type = ICMP6_ECHO_REQUEST;
+		return;
+	}
 
-	/* TODO fill packet. */
+	icmp->icmp_type = ICMP_ECHO;
+	icmp->icmp_cksum = in_cksum((uint16_t *) ih->ih_tmpl,
+	    sizeof(ih->ih_tmpl));
+}
+
+/*
+ * Generate ICMP packet in `buf` and track it in the host ring.
+ *
+ * `buf` payload must already be zeroed, only the header is written here.
+ */
+struct icmp_packet *
+new_ip(struct icmp_host *ih, char *buf, size_t buflen)
+{
+	struct icmp_packet *ip;
+	struct icmp *icmp;
+	uint32_t cookie;
+	uint16_t seq, word[2];
+
+	if (buflen < IH_TMPL_LEN)
+		fatalx("%s: buffer too short (%zu)", __FUNCTION__, buflen);
+
+	seq = ih->ih_seq++;
+	cookie = htonl(ih_mac(ih, ih->ih_loss.ls_sent, 0));
+
+	/*
+	 * A packet still holding our slot is IH_IPSLOTS sequences old,
+	 * its reply would be ambiguous anyway so reuse it.
+	 */
+	ip = &ih->ih_ipring[seq & (IH_IPSLOTS - 1)];
+	if (ip->ip_inuse == 0) {
+		ip->ip_inuse = 1;
+		ih->ih_ipcount++;
+	}
+
+	ip->ip_seq = seq;
+	ip->ip_sent = 0; /* stamped right before transmission */
 
-	icmp->icmp_cksum = in_cksum((uint16_t *) icmp, sizeof(ip->ip_buf));
+	/* Copy the template and patch the sequence and MAC into it. */
+	memcpy(buf, ih->ih_tmpl, sizeof(ih->ih_tmpl));
+	icmp = (struct icmp *) buf;
+	icmp->icmp_seq = htons(ip->ip_seq);
+	memcpy(&buf[ICMP_MINLEN + offsetof(struct ih_payload, ihp_cookie)],
+	    &cookie, sizeof(cookie));
+	if (ih->ih_ss.ss_family == AF_INET) {
+		memcpy(word, &cookie, sizeof(word));
+		icmp->icmp_cksum = in_cksum_update(icmp->icmp_cksum, 0,
+		    icmp->icmp_seq);
+		icmp->icmp_cksum = in_cksum_update(icmp->icmp_cksum, 0,
+		    word[0]);
+		icmp->icmp_cksum = in_cksum_update(icmp->icmp_cksum, 0,
+		    word[1]);
+	}
 
 	return (ip);
 }
@@ -133,14 +435,11 @@ find_ip(struct icmp_host *ih, uint16_t seq)
 {
 	struct icmp_packet *ip;
 
-	TAILQ_FOREACH(ip, &ih->ih_iplist, ip_entry) {
-		if (ip->ip_seq != seq)
-			continue;
-
-		return (ip);
-	}
+	ip = &ih->ih_ipring[seq & (IH_IPSLOTS - 1)];
+	if (ip->ip_inuse == 0 || ip->ip_seq != seq)
+		return (NULL);
 
-	return (NULL);
+	return (ip);
 }
 
 /* Remove ICMP packet. */
@@ -148,59 +447,275 @@ void
 free_ip(struct icmp_host *ih, struct icmp_packet *ip)
 {
 	ih->ih_ipcount--;
-	TAILQ_REMOVE(&ih->ih_iplist, ip, ip_entry);
-	free(ip);
+	ip->ip_inuse = 0;
 }
 
-/* Reschedule packet timeout */
+/* Remove all in-flight ICMP packets. */
 void
-reschedule_icmp_send(struct icmp_host *ih)
+free_ip_all(struct icmp_host *ih)
+{
+	int i;
+
+	/* Stateless probes have nothing in flight. */
+	if (ih->ih_ipring == NULL)
+		return;
+
+	for (i = 0; i < IH_IPSLOTS; i++)
+		ih->ih_ipring[i].ip_inuse = 0;
+
+	ih->ih_ipcount = 0;
+}
+
+/*
+ * Probe MAC: the host cookie already binds the index to the address, so
+ * authenticate it along with the probe number and send time (zero for
+ * stateful probes). The probe number is not carried in the packet, the
+ * receiver derives it from the sequence with loss_probe(): a reply
+ * replayed once the 16 bit sequence wrapped no longer matches.
+ */
+uint32_t
+ih_mac(struct icmp_host *ih, uint64_t probe, uint64_t sent)
 {
-	/* Default timeout to receive ICMP packet */
-	static struct timeval deftimeout = { 10, 0 };
-	static struct timeval defdelaytimeout = { 60, 0 };
+	uint8_t buf[sizeof(ih->ih_cookie) + sizeof(probe) + sizeof(sent)];
+
+	memcpy(buf, &ih->ih_cookie, sizeof(ih->ih_cookie));
+	memcpy(&buf[sizeof(ih->ih_cookie)], &probe, sizeof(probe));
+	memcpy(&buf[sizeof(ih->ih_cookie) + sizeof(probe)], &sent,
+	    sizeof(sent));
+
+	return ((uint32_t) siphash24(sc.sc_icmp_key, buf, sizeof(buf)));
+}
+
+/*
+ * Generate a stateless ICMP packet in `buf`, nothing is remembered about
+ * it: ip_stateless_stamp() fills the send time right before transmission.
+ */
+uint16_t
+new_ip_stateless(struct icmp_host *ih, char *buf, size_t buflen)
+{
+	struct icmp *icmp;
+	uint16_t seq;
+
+	/* ip_stateless_stamp() writes the payload inside the template. */
+	if (buflen < IH_TMPL_LEN)
+		fatalx("%s: buffer too short (%zu)", __FUNCTION__, buflen);
+
+	seq = ih->ih_seq++;
+
+	memcpy(buf, ih->ih_tmpl, sizeof(ih->ih_tmpl));
+	icmp = (struct icmp *) buf;
+	icmp->icmp_seq = htons(seq);
 
-	if (ih->ih_ihs == IHS_UP)
-		evtimer_add(ih->ih_to, &deftimeout);
-	else /* Host went down, increase the timeout with a delay. */
-		evtimer_add(ih->ih_to, &defdelaytimeout);
+	return (seq);
+}
+
+/* Write the send time and its MAC into a stateless packet. */
+void
+ip_stateless_stamp(struct icmp_host *ih, char *buf, uint64_t sent)
+{
+	struct icmp *icmp = (struct icmp *) buf;
+	struct ih_payload ihp;
+
+	memcpy(&ihp, &buf[ICMP_MINLEN], sizeof(ihp));
+	ihp.ihp_sent = sent;
+	ihp.ihp_cookie = htonl(ih_mac(ih,
+	    loss_probe(&ih->ih_loss, ntohs(icmp->icmp_seq)), sent));
+	memcpy(&buf[ICMP_MINLEN], &ihp, sizeof(ihp));
+
+	/* Only the template part is not zero, the rest adds nothing. */
+	if (ih->ih_ss.ss_family == AF_INET) {
+		icmp->icmp_cksum = 0;
+		icmp->icmp_cksum = in_cksum((uint16_t *) buf,
+		    sizeof(ih->ih_tmpl));
+	}
 }
 
 /*
- * Shamelessly stolen from ping.c from OpenBSD.
+ * Length of the loss window of the probes.
  *
- * in_cksum --
- *	Checksum routine for Internet Protocol family headers (C Version)
+ * A stateful reply past the ring has no send time to match. A reply
+ * inside the window whose slot was already freed (host down, ICMP error
+ * or retarget) still counts as received: the host answered, it only
+ * gives no RTT sample.
  */
 int
-in_cksum(const uint16_t *addr, int len)
+loss_window_len(void)
 {
-	int nleft = len;
-	const uint16_t *w = addr;
-	int sum = 0;
-	uint16_t answer = 0;
+	return (sc.sc_icmp_stateless ? LOSS_WINDOW : IH_IPSLOTS);
+}
 
-	/*
-	 * Our algorithm is simple, using a 32 bit accumulator (sum), we add
-	 * sequential 16 bit words to it, and at the end, fold back all the
-	 * carry bits from the top 16 bits into the lower 16 bits.
-	 */
-	while (nleft > 1)  {
-		sum += *w++;
-		nleft -= 2;
+/* Account a probe sent, the oldest one leaves the window. */
+void
+loss_sent(struct loss_stats *ls)
+{
+	if (ls->ls_sent >= ls->ls_size &&
+	    (ls->ls_window & (1ULL << (ls->ls_size - 1))) == 0)
+		ls->ls_lost++;
+
+	ls->ls_window <<= 1;
+	ls->ls_sent++;
+}
+
+/* Account a reply for sequence `seq`. */
+enum loss_event
+loss_recv(struct loss_stats *ls, uint16_t seq)
+{
+	uint64_t bit;
+	uint16_t age;
+
+	/* How many probes ago it was sent, sequences are 16 bits. */
+	age = (uint16_t) (ls->ls_sent - 1) - seq;
+	if (ls->ls_sent == 0 || age >= MIN(ls->ls_sent, ls->ls_size)) {
+		ls->ls_late++;
+		return (LOSS_LATE);
 	}
 
-	/* mop up an odd byte, if necessary */
-	if (nleft == 1) {
-		*(u_char *)(&answer) = *(u_char *) w ;
-		sum += answer;
+	bit = 1ULL << age;
+	if (ls->ls_window & bit) {
+		ls->ls_dup++;
+		return (LOSS_DUP);
 	}
 
-	/* add back carry outs from top 16 bits to low 16 bits */
-	sum = (sum >> 16) + (sum & 0xffff);	/* add hi 16 to low 16 */
-	sum += (sum >> 16);			/* add carry */
-	answer = ~sum;				/* truncate to 16 bits */
-	return (answer);
+	/* Some newer probe was answered first. */
+	if (ls->ls_window & (bit - 1))
+		ls->ls_reordered++;
+
+	ls->ls_window |= bit;
+	ls->ls_received++;
+	return (LOSS_NEW);
+}
+
+/* Number of the last probe sent with sequence `seq`. */
+uint64_t
+loss_probe(const struct loss_stats *ls, uint16_t seq)
+{
+	return (ls->ls_sent - 1 -
+	    (uint16_t) ((uint16_t) (ls->ls_sent - 1) - seq));
+}
+
+/* RFC 3550 jitter, transit time differences are RTT differences here. */
+void
+loss_rtt(struct loss_stats *ls, uint64_t rtt)
+{
+	double d;
+
+	if (ls->ls_received > 1) {
+		d = (rtt > ls->ls_lastrtt) ? rtt - ls->ls_lastrtt :
+		    ls->ls_lastrtt - rtt;
+		ls->ls_jitter += (d - ls->ls_jitter) / 16;
+	}
+	ls->ls_lastrtt = rtt;
+}
+
+/*
+ * Loss percentage inside the window. The last probe is left out, its
+ * reply may still be on the way.
+ */
+double
+loss_window_pct(const struct loss_stats *ls)
+{
+	uint64_t n, mask;
+
+	n = MIN(ls->ls_sent, ls->ls_size);
+	if (n < 2)
+		return (0);
+
+	n--;
+	mask = ((1ULL << n) - 1) << 1;
+	return (100.0 * (n - __builtin_popcountll(ls->ls_window & mask)) /
+	    n);
+}
+
+/* Histogram bucket of a RTT sample. */
+static int
+rtt_hist_bucket(uint64_t rtt)
+{
+	uint64_t v = rtt >> RTT_HIST_UNITSHIFT;
+	int msb, shift, bucket;
+
+	if (v < RTT_HIST_SUB)
+		return (v);
+
+	msb = 63 - __builtin_clzll(v);
+	shift = msb - RTT_HIST_SUBBITS;
+	bucket = ((shift + 1) << RTT_HIST_SUBBITS) +
+	    ((v >> shift) & (RTT_HIST_SUB - 1));
+
+	return (MIN(bucket, RTT_HIST_LEN - 1));
+}
+
+/* Lowest RTT that falls into a histogram bucket. */
+static uint64_t
+rtt_hist_value(int bucket)
+{
+	int shift;
+
+	if (bucket < RTT_HIST_SUB)
+		return ((uint64_t) bucket << RTT_HIST_UNITSHIFT);
+
+	shift = (bucket >> RTT_HIST_SUBBITS) - 1;
+	return (((uint64_t) (RTT_HIST_SUB | (bucket & (RTT_HIST_SUB - 1))) <<
+	    shift) << RTT_HIST_UNITSHIFT);
+}
+
+/* Account a new RTT sample. */
+void
+rtt_update(struct rtt_stats *rs, uint64_t rtt)
+{
+	double delta;
+
+	if (rs->rs_count == 0 || rtt < rs->rs_min)
+		rs->rs_min = rtt;
+	if (rtt > rs->rs_max)
+		rs->rs_max = rtt;
+
+	rs->rs_last = rtt;
+	rs->rs_count++;
+	delta = rtt - rs->rs_mean;
+	rs->rs_mean += delta / rs->rs_count;
+	rs->rs_m2 += delta * (rtt - rs->rs_mean);
+
+	rs->rs_hist[rtt_hist_bucket(rtt)]++;
+}
+
+/* RTT sample standard deviation. */
+uint64_t
+rtt_stddev(const struct rtt_stats *rs)
+{
+	if (rs->rs_count < 2)
+		return (0);
+
+	return (sqrt(rs->rs_m2 / (rs->rs_count - 1)));
+}
+
+/* RTT percentile (0-100) estimated from the histogram. */
+uint64_t
+rtt_percentile(const struct rtt_stats *rs, double pct)
+{
+	uint64_t rank, value, seen = 0;
+	int i;
+
+	if (rs->rs_count == 0)
+		return (0);
+
+	rank = ceil(rs->rs_count * pct / 100.0);
+	if (rank == 0)
+		rank = 1;
+
+	for (i = 0; i < RTT_HIST_LEN; i++) {
+		seen += rs->rs_hist[i];
+		if (seen < rank)
+			continue;
+
+		/* Buckets are coarse, stay within what was measured. */
+		value = rtt_hist_value(i);
+		if (value < rs->rs_min)
+			return (rs->rs_min);
+
+		return (MIN(value, rs->rs_max));
+	}
+
+	return (rs->rs_max);
 }
 
 /* Register ICMP host to database. */
@@ -270,14 +785,45 @@ icmp_host_db_id(const char *name)
 	return (dbid);
 }
 
+/* Record the current state and statistics of the host. */
+void
+ih_event_init(struct icmp_host *ih, struct icmp_host_event *ihe)
+{
+	struct rtt_stats *rs = &ih->ih_rtt;
+	struct loss_stats *ls = &ih->ih_loss;
+
+	memset(ihe, 0, sizeof(*ihe));
+	ihe->ihe_time = real_ns();
+	ihe->ihe_index = ih->ih_index;
+	ihe->ihe_state = ih->ih_ihs;
+
+	ihe->ihe_rttcount = rs->rs_count;
+	if (rs->rs_count) {
+		ihe->ihe_rttmin = rs->rs_min;
+		ihe->ihe_rttavg = rs->rs_mean;
+		ihe->ihe_rttmax = rs->rs_max;
+		ihe->ihe_rttstddev = rtt_stddev(rs);
+		ihe->ihe_rttp50 = rtt_percentile(rs, 50);
+		ihe->ihe_rttp99 = rtt_percentile(rs, 99);
+	}
+
+	ihe->ihe_losspct = loss_window_pct(ls) * 10;
+	ihe->ihe_sent = ls->ls_sent;
+	ihe->ihe_lost = ls->ls_lost;
+	ihe->ihe_late = ls->ls_late;
+	ihe->ihe_dup = ls->ls_dup;
+	ihe->ihe_reordered = ls->ls_reordered;
+	ihe->ihe_jitter = ls->ls_jitter;
+}
+
 /* Log ICMP host events to the database. */
 void
-log_icmp_host_event(struct icmp_host *ih, enum icmp_host_status ihs)
+log_icmp_host_event(struct icmp_host *ih, const struct icmp_host_event *ihe)
 {
 	struct sqlite3_stmt *ss;
 	uint32_t dbid;
 
-	switch (ihs) {
+	switch (ihe->ihe_state) {
 	case IHS_UP:
 		log_info("Host %s (%s) is now online",
 		    ih->ih_name, ih->ih_address);
@@ -291,13 +837,39 @@ log_icmp_host_event(struct icmp_host *ih, enum icmp_host_status ihs)
 		return;
 	}
 
+	if (ihe->ihe_rttcount)
+		log_info("Host %s (%s) rtt min/avg/max/stddev = "
+		    "%.3f/%.3f/%.3f/%.3f ms, p50 %.3f ms, p99 %.3f ms",
+		    ih->ih_name, ih->ih_address, ihe->ihe_rttmin / 1e6,
+		    ihe->ihe_rttavg / 1e6, ihe->ihe_rttmax / 1e6,
+		    ihe->ihe_rttstddev / 1e6, ihe->ihe_rttp50 / 1e6,
+		    ihe->ihe_rttp99 / 1e6);
+
+	if (ihe->ihe_sent)
+		log_info("Host %s (%s) loss %.1f%% (last %d), %llu lost, "
+		    "%llu late, %llu duplicated, %llu reordered, "
+		    "jitter %.3f ms", ih->ih_name, ih->ih_address,
+		    ihe->ihe_losspct / 10.0, loss_window_len(),
+		    (unsigned long long) ihe->ihe_lost,
+		    (unsigned long long) ihe->ihe_late,
+		    (unsigned long long) ihe->ihe_dup,
+		    (unsigned long long) ihe->ihe_reordered,
+		    ihe->ihe_jitter / 1e6);
+
 	dbid = icmp_host_db_id(ih->ih_name);
 
-	ss = db_prepare("INSERT INTO icmp_host_events (icmp_host_id, event) VALUES (?, ?);");
+	ss = db_prepare("INSERT INTO icmp_host_events (icmp_host_id, event, "
+	    "time, rtt_min, rtt_avg, rtt_max, rtt_stddev, loss_permille, lost, "
+	    "late, duplicated, reordered, jitter) "
+	    "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);");
 	if (ss == NULL)
 		log_warnx("# Failed to log host event");
 
-	db_bindf(ss, "%i%i", dbid, ihs);
+	db_bindf(ss, "%i%i%d%d%d%d%d%i%d%d%d%d%d", dbid, ihe->ihe_state,
+	    ihe->ihe_time, ihe->ihe_rttmin, ihe->ihe_rttavg, ihe->ihe_rttmax,
+	    ihe->ihe_rttstddev, (uint32_t) ihe->ihe_losspct,
+	    ihe->ihe_lost, ihe->ihe_late, ihe->ihe_dup, ihe->ihe_reordered,
+	    ihe->ihe_jitter);
 	if (db_run(ss) != SQLITE_OK)
 		log_warnx("%s: failed to log event", __FUNCTION__);
 
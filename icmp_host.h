@@ -23,6 +23,8 @@
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
 
 /* Forward structure declaration */
 struct proc_ctx;
@@ -67,25 +69,152 @@ socklen_t slen_sa(struct sockaddr *);
 /* Debug functions */
 void log_sa(struct sockaddr *);
 
-/* ICMP packet */
+/* In-flight ICMP packet slot */
 struct icmp_packet {
-	TAILQ_ENTRY(icmp_packet) ip_entry;
-	struct timeval ip_tv;
+	uint64_t ip_sent; /* monotonic send time in nanoseconds */
 	uint16_t ip_seq;
-	char ip_buf[1536];
+	uint8_t ip_inuse;
+};
+
+/*
+ * Round-trip time statistics in nanoseconds.
+ *
+ * The histogram is log-linear (HDR style): RTT_HIST_SUB linear buckets
+ * for every power of two of microseconds, which keeps the relative error
+ * of percentiles under 1 / RTT_HIST_SUB.
+ */
+#define RTT_HIST_SUBBITS (3)
+#define RTT_HIST_SUB (1 << RTT_HIST_SUBBITS)
+#define RTT_HIST_UNITSHIFT (10) /* ~1 microsecond units */
+#define RTT_HIST_LEN (26 << RTT_HIST_SUBBITS) /* up to ~4 minutes */
+
+struct rtt_stats {
+	uint64_t rs_count;
+	uint64_t rs_last;
+	uint64_t rs_min;
+	uint64_t rs_max;
+	double rs_mean; /* running mean and squared deviation (Welford) */
+	double rs_m2;
+	uint32_t rs_hist[RTT_HIST_LEN];
+};
+
+/*
+ * Probe loss statistics over a sliding window of the last LOSS_WINDOW
+ * sequences: bit `n` of the bitmap tells if the probe sent `n` probes
+ * ago was answered. Probes leaving the window unanswered are lost.
+ * Stateful probes only keep the send time of the last IH_IPSLOTS, their
+ * window is that short so replies past it are late, not received.
+ *
+ * Probes are accounted when queued: one that fails to be transmitted
+ * locally still took its sequence and counts as lost.
+ */
+#define LOSS_WINDOW (64)
+
+enum loss_event {
+	LOSS_NEW = 0, /* first reply for the probe */
+	LOSS_DUP, /* probe already answered */
+	LOSS_LATE, /* probe already out of the window, counted lost */
+};
+
+struct loss_stats {
+	uint64_t ls_window;
+	uint32_t ls_size; /* window length, see loss_window_len() */
+	uint64_t ls_sent;
+	uint64_t ls_received;
+	uint64_t ls_lost;
+	uint64_t ls_late;
+	uint64_t ls_dup;
+	uint64_t ls_reordered; /* answered after a newer probe */
+	double ls_jitter; /* RFC 3550 interarrival jitter (ns) */
+	uint64_t ls_lastrtt;
 };
 
 /* ICMP host item */
+#define IH_DEF_INTERVAL_MS (10 * 1000)
+#define IH_DEF_DOWN_INTERVAL_MS (60 * 1000)
 #define IH_DEF_RETRYCOUNT (3)
+/* Shortest interval or timeout, the timer wheel resolution. */
+#define IH_MIN_TIME_MS (TW_TICK_MS)
+
+/* Probe timing, times in nanoseconds. */
+struct icmp_timing {
+	uint64_t it_interval; /* between probes of up hosts */
+	uint64_t it_timeout; /* reply wait before a retry, zero is interval */
+	uint64_t it_down_interval; /* between probes of down hosts */
+	unsigned it_retry; /* unanswered probes before going down */
+};
+
+/*
+ * Echo payload identifying the probe: the host index and a MAC keyed
+ * with sc_icmp_key (network byte order) of the index, address and probe
+ * number, so replies can be matched with a single array access and
+ * forged or replayed ones rejected, see ih_mac().
+ *
+ * In stateless mode the payload also carries the send time, which the
+ * MAC covers too.
+ */
+struct ih_payload {
+	uint32_t ihp_index;
+	uint32_t ihp_cookie;
+	uint64_t ihp_sent; /* monotonic, host byte order: only we read it */
+};
+
+/* Echo template: header plus the identity echoed back in the payload. */
+#define IH_TMPL_LEN (ICMP_MINLEN + sizeof(struct ih_payload))
+
+/* IMSG_HOST_ADDRESS: new resolved address of a host. */
+struct icmp_host_address {
+	uint32_t iha_index;
+	struct sockaddr_storage iha_ss;
+};
+
+/* In-flight packet ring size, must be a power of two. */
+#define IH_IPSLOTS (16)
 
 enum icmp_host_status {
 	IHS_DOWN = 0,
 	IHS_UP = 1,
 };
 
+/*
+ * Host state change as the workers report it to the parent on the
+ * results ring. The host is identified by its index and the record
+ * carries a summary of its statistics at the time of the change.
+ */
+struct icmp_host_event {
+	uint64_t ihe_time; /* real time (ns) */
+	uint32_t ihe_index;
+	uint16_t ihe_state; /* enum icmp_host_status */
+	uint16_t ihe_losspct; /* window loss in tenths of percent */
+
+	/* RTT summary (ns) */
+	uint64_t ihe_rttcount;
+	uint64_t ihe_rttmin;
+	uint64_t ihe_rttavg;
+	uint64_t ihe_rttmax;
+	uint64_t ihe_rttstddev;
+	uint64_t ihe_rttp50;
+	uint64_t ihe_rttp99;
+
+	/* Loss summary */
+	uint64_t ihe_sent;
+	uint64_t ihe_lost;
+	uint64_t ihe_late;
+	uint64_t ihe_dup;
+	uint64_t ihe_reordered;
+	uint64_t ihe_jitter; /* ns */
+};
+
 struct icmp_host {
 	TAILQ_ENTRY(icmp_host) ih_entry;
-	TAILQ_HEAD(, icmp_packet) ih_iplist;
+	struct icmp_packet *ih_ipring; /* IH_IPSLOTS, indexed by sequence */
+
+	/* Reply statistics */
+	struct rtt_stats ih_rtt;
+	struct loss_stats ih_loss;
+
+	/* Prebuilt echo request header with sequence zero. */
+	uint8_t ih_tmpl[IH_TMPL_LEN];
 
 	/* Process pointer */
 	struct proc_ctx *ih_pc;
@@ -94,30 +223,85 @@ struct icmp_host {
 	char *ih_name;
 	char *ih_address;
 	struct sockaddr_storage ih_ss;
+	struct icmp_timing ih_timing;
+
+	/* Probe identity */
+	uint32_t ih_index; /* position in the configuration */
+	uint32_t ih_cookie; /* binds index and address, see ih_mac() */
+	uint16_t ih_id; /* echo id of the worker */
 
 	/* Current probe status */
-	uint16_t ih_id;
 	uint16_t ih_seq;
 	unsigned ih_retrycount;
 	unsigned ih_ipcount;
 	enum icmp_host_status ih_ihs;
 
 	struct timeval ih_ltv; /* last event time */
-	struct event *ih_to; /* event registration */
+	struct tw_entry ih_twe; /* probe deadline */
+	uint64_t ih_due; /* scheduled time of the next probe */
+	uint64_t ih_slot; /* next time on the host grid */
+
+	/* Latest state change the results ring had no room for. */
+	struct icmp_host_event ih_ihe;
+	TAILQ_ENTRY(icmp_host) ih_iheentry;
+	int ih_ihepending;
+};
+
+/* RTT sample of a host, as the workers report it to the parent. */
+struct icmp_host_rtt {
+	uint64_t ihr_rtt; /* ns */
+	uint32_t ihr_index;
+};
+
+/* Worker result on the shared memory ring of the parent. */
+enum icmp_record_type {
+	IR_EVENT = 0,
+	IR_RTT,
+};
+
+struct icmp_record {
+	uint32_t ir_type; /* enum icmp_record_type */
+	union {
+		struct icmp_host_event u_event;
+		struct icmp_host_rtt u_rtt;
+	} ir_u;
+#define ir_event ir_u.u_event
+#define ir_rtt ir_u.u_rtt
 };
 
 /* icmp_host.c */
-struct icmp_host *new_ih(uint16_t);
-struct icmp_host *find_ih(uint16_t);
-int in_cksum(const uint16_t *, int);
+struct icmp_host *new_ih(uint32_t);
+int ih_address_parse(const char *, struct sockaddr_storage *);
+int ih_address_cmp(struct sockaddr_storage *, struct sockaddr_storage *);
+int ih_table_init(uint32_t, uint32_t);
+struct icmp_host *find_ih(uint32_t);
+int ih_addr_table_init(void);
+struct icmp_host *find_ih_addr(int, const void *);
 
-struct icmp_packet *new_ip(struct icmp_host *, struct proc_ctx *);
+int ih_ipring_init(void);
+void ih_tmpl_init(struct icmp_host *);
+struct icmp_packet *new_ip(struct icmp_host *, char *, size_t);
 struct icmp_packet *find_ip(struct icmp_host *, uint16_t);
 void free_ip(struct icmp_host *, struct icmp_packet *);
+void free_ip_all(struct icmp_host *);
+
+uint16_t new_ip_stateless(struct icmp_host *, char *, size_t);
+void ip_stateless_stamp(struct icmp_host *, char *, uint64_t);
+uint32_t ih_mac(struct icmp_host *, uint64_t, uint64_t);
+
+void rtt_update(struct rtt_stats *, uint64_t);
+uint64_t rtt_stddev(const struct rtt_stats *);
+uint64_t rtt_percentile(const struct rtt_stats *, double);
 
-void reschedule_icmp_send(struct icmp_host *);
+void loss_sent(struct loss_stats *);
+enum loss_event loss_recv(struct loss_stats *, uint16_t);
+uint64_t loss_probe(const struct loss_stats *, uint16_t);
+void loss_rtt(struct loss_stats *, uint64_t);
+int loss_window_len(void);
+double loss_window_pct(const struct loss_stats *);
 
 int register_icmp_host(struct icmp_host *);
-void log_icmp_host_event(struct icmp_host *, enum icmp_host_status);
+void ih_event_init(struct icmp_host *, struct icmp_host_event *);
+void log_icmp_host_event(struct icmp_host *, const struct icmp_host_event *);
 
 #endif /* _ICMP_HOST_H_ */
@@ -67,6 +67,10 @@ static int		 errors = 0;
 static uint16_t		 icmp_id_start = 0;
 
 struct icmp_host *current_ih;
+struct icmp_timing *current_it;
+
+/* Longest time accepted, in milliseconds: a day. */
+#define TIME_MAX_MS (24LL * 60 * 60 * 1000)
 
 %}
 
@@ -79,10 +83,13 @@ struct icmp_host *current_ih;
 };
 
 %token	CHROOT USER INCLUDE
-%token	ICMP_PROBE ADDRESS NAME
+%token	ICMP_IO ICMP_MODE ICMP_PPS ICMP_PROBE ICMP_SOCKET ICMP_WORKERS ADDRESS NAME
+%token	INTERVAL TIMEOUT RETRY DOWN_INTERVAL NAMESERVER
+%token	XDP_INTERFACE XDP_QUEUE
 %token	ERROR
 %token	<v.string>	STRING
 %token	<v.number>	NUMBER
+%type	<v.number>	time
 
 %%
 
@@ -108,11 +115,186 @@ include	: INCLUDE STRING {
 	}
 	;
 
+/*
+ * Time in milliseconds: plain numbers are seconds, or 500ms, 10s, 5m, 1h.
+ * At most TIME_MAX_MS, the timings are kept in nanoseconds.
+ */
+time	: NUMBER {
+		if ($1 < 0 || $1 > (TIME_MAX_MS / 1000)) {
+			yyerror("invalid time %lld", (long long) $1);
+			YYERROR;
+		}
+		$$ = $1 * 1000;
+	}
+	| STRING {
+		long long	 value;
+		char		*unit;
+
+		$$ = -1;
+		value = strtoll($1, &unit, 10);
+		if (unit != $1 && value >= 0 && value <= INT32_MAX) {
+			if (strcmp(unit, "ms") == 0)
+				$$ = value;
+			else if (strcmp(unit, "s") == 0)
+				$$ = value * 1000;
+			else if (strcmp(unit, "m") == 0)
+				$$ = value * 60 * 1000;
+			else if (strcmp(unit, "h") == 0)
+				$$ = value * 60 * 60 * 1000;
+		}
+		if ($$ > TIME_MAX_MS)
+			$$ = -1;
+		if ($$ == -1) {
+			yyerror("invalid time %s", $1);
+			free($1);
+			YYERROR;
+		}
+		free($1);
+	}
+	;
+
+/* Probe timing, global defaults or inside an icmp-probe block. */
+timing	: INTERVAL time {
+		if ($2 < IH_MIN_TIME_MS) {
+			yyerror("interval must be at least %dms",
+			    IH_MIN_TIME_MS);
+			YYERROR;
+		}
+		current_it->it_interval = $2 * 1000000ULL;
+	}
+	| TIMEOUT time {
+		if ($2 < IH_MIN_TIME_MS) {
+			yyerror("timeout must be at least %dms",
+			    IH_MIN_TIME_MS);
+			YYERROR;
+		}
+		current_it->it_timeout = $2 * 1000000ULL;
+	}
+	| DOWN_INTERVAL time {
+		if ($2 < IH_MIN_TIME_MS) {
+			yyerror("down-interval must be at least %dms",
+			    IH_MIN_TIME_MS);
+			YYERROR;
+		}
+		current_it->it_down_interval = $2 * 1000000ULL;
+	}
+	| RETRY NUMBER {
+		if ($2 < 0 || $2 > 255) {
+			yyerror("retry must be between 0 and 255");
+			YYERROR;
+		}
+		current_it->it_retry = $2;
+	}
+	;
+
 main:	USER STRING { sconf->sc_user = strdup($2); }
+	| timing
 	| CHROOT STRING { sconf->sc_chroot = strdup($2); }
+	| ICMP_SOCKET STRING {
+		if (strcmp($2, "raw") == 0)
+			sconf->sc_icmp_socket = ICMP_SOCKET_RAW;
+		else if (strcmp($2, "datagram") == 0) {
+#ifdef LINUX_SUPPORT
+			sconf->sc_icmp_socket = ICMP_SOCKET_DGRAM;
+#else
+			yyerror("datagram ICMP sockets are not supported");
+			free($2);
+			YYERROR;
+#endif /* LINUX_SUPPORT */
+		} else {
+			yyerror("unknown icmp-socket type %s", $2);
+			free($2);
+			YYERROR;
+		}
+		free($2);
+	}
+	| ICMP_IO STRING {
+		if (strcmp($2, "event") == 0)
+			sconf->sc_icmp_io = ICMP_IO_EVENT;
+		else if (strcmp($2, "io_uring") == 0) {
+#ifdef IO_URING_SUPPORT
+			sconf->sc_icmp_io = ICMP_IO_URING;
+#else
+			yyerror("io_uring support is not compiled in");
+			free($2);
+			YYERROR;
+#endif /* IO_URING_SUPPORT */
+		} else if (strcmp($2, "packet") == 0) {
+#ifdef LINUX_SUPPORT
+			sconf->sc_icmp_io = ICMP_IO_PACKET;
+#else
+			yyerror("packet I/O is only supported on Linux");
+			free($2);
+			YYERROR;
+#endif /* LINUX_SUPPORT */
+		} else if (strcmp($2, "xdp") == 0) {
+#ifdef XDP_SUPPORT
+			sconf->sc_icmp_io = ICMP_IO_XDP;
+#else
+			yyerror("XDP support is not compiled in");
+			free($2);
+			YYERROR;
+#endif /* XDP_SUPPORT */
+		} else {
+			yyerror("unknown icmp-io type %s", $2);
+			free($2);
+			YYERROR;
+		}
+		free($2);
+	}
+	| XDP_INTERFACE STRING {
+		free(sconf->sc_xdp_ifname);
+		sconf->sc_xdp_ifname = $2;
+	}
+	| XDP_QUEUE NUMBER {
+		if ($2 < 0 || $2 > 63) {
+			yyerror("xdp-queue must be between 0 and 63");
+			YYERROR;
+		}
+		sconf->sc_xdp_queue = $2;
+	}
+	| ICMP_MODE STRING {
+		if (strcmp($2, "stateful") == 0)
+			sconf->sc_icmp_stateless = 0;
+		else if (strcmp($2, "stateless") == 0)
+			sconf->sc_icmp_stateless = 1;
+		else {
+			yyerror("unknown icmp-mode %s", $2);
+			free($2);
+			YYERROR;
+		}
+		free($2);
+	}
+	| ICMP_PPS NUMBER {
+		if ($2 < 0 || $2 > UINT32_MAX) {
+			yyerror("invalid icmp-pps %lld", (long long) $2);
+			YYERROR;
+		}
+		sconf->sc_icmp_pps = $2;
+	}
+	| ICMP_WORKERS NUMBER {
+		if ($2 < 1 || $2 > ICMP_MAX_WORKERS) {
+			yyerror("icmp-workers must be between 1 and %d",
+			    ICMP_MAX_WORKERS);
+			YYERROR;
+		}
+		sconf->sc_icmp_workers = $2;
+	}
+	| NAMESERVER STRING {
+		if (sconf->sc_nameservercount == DNS_MAX_NAMESERVERS) {
+			yyerror("too many nameservers, the limit is %d",
+			    DNS_MAX_NAMESERVERS);
+			free($2);
+			YYERROR;
+		}
+		sconf->sc_nameservers[sconf->sc_nameservercount++] = $2;
+	}
 	| ICMP_PROBE '{' optnl {
-		current_ih = new_ih(icmp_id_start++);
+		current_ih = new_ih(sconf->sc_ihcount++);
+		current_ih->ih_timing = sconf->sc_timing;
+		current_it = &current_ih->ih_timing;
 	} icmp_probe_stmt optnl '}' {
+		current_it = &sconf->sc_timing;
 		if (current_ih->ih_name == NULL)
 			fatalx("%s:%d no probe name", file->name,
 			    file->lineno);
@@ -135,6 +317,7 @@ icmp_probe_stmt: /* empty */
 		if (current_ih->ih_name == NULL)
 			fatal("not enough memory");
 	}
+	| timing '\n' icmp_probe_stmt
 	;
 
 optnl	: '\n' optnl
@@ -176,10 +359,22 @@ lookup(char *s)
 	static const struct keywords keywords[] = {
 		{ "address",		ADDRESS },
 		{ "chroot",		CHROOT },
+		{ "down-interval",	DOWN_INTERVAL },
+		{ "icmp-io",		ICMP_IO },
+		{ "icmp-mode",		ICMP_MODE },
+		{ "icmp-pps",		ICMP_PPS },
 		{ "icmp-probe",		ICMP_PROBE },
+		{ "icmp-socket",	ICMP_SOCKET },
+		{ "icmp-workers",	ICMP_WORKERS },
 		{ "include",		INCLUDE },
+		{ "interval",		INTERVAL },
 		{ "name",		NAME },
+		{ "nameserver",		NAMESERVER },
+		{ "retry",		RETRY },
+		{ "timeout",		TIMEOUT },
 		{ "user",		USER },
+		{ "xdp-interface",	XDP_INTERFACE },
+		{ "xdp-queue",		XDP_QUEUE },
 	};
 	const struct keywords	*p;
 
@@ -480,11 +675,15 @@ parse_config(const char *filename, struct serverstatd_conf *sc)
 {
 	errors = 0;
 	sconf = sc;
+	/* Random echo id base, with room for one id per worker above it. */
 #ifdef LINUX_SUPPORT
 	/* Dirty hack: linux has no arc4random support. */
-	icmp_id_start = (rand() % 0xFFFF) + 1;
+	icmp_id_start = (rand() % (UINT16_MAX - ICMP_MAX_WORKERS)) + 1;
+	if (getentropy(sc->sc_icmp_key, sizeof(sc->sc_icmp_key)) == -1)
+		fatal("getentropy");
 #else
-	icmp_id_start = arc4random_uniform(0xFFFF) + 1;
+	icmp_id_start = arc4random_uniform(UINT16_MAX - ICMP_MAX_WORKERS) + 1;
+	arc4random_buf(sc->sc_icmp_key, sizeof(sc->sc_icmp_key));
 #endif /* LINUX_SUPPORT */
 
 	if ((file = pushfile(filename, 0)) == NULL)
@@ -492,9 +691,55 @@ parse_config(const char *filename, struct serverstatd_conf *sc)
 
 	topfile = file;
 
+	sconf->sc_icmp_workers = 1;
+	sconf->sc_timing.it_interval = IH_DEF_INTERVAL_MS * 1000000ULL;
+	sconf->sc_timing.it_timeout = 0;
+	sconf->sc_timing.it_down_interval = IH_DEF_DOWN_INTERVAL_MS * 1000000ULL;
+	sconf->sc_timing.it_retry = IH_DEF_RETRYCOUNT;
+	current_it = &sconf->sc_timing;
+	sconf->sc_icmp_idbase = icmp_id_start;
 	yyparse();
 	errors = file->errors;
 	popfile();
 
+	/* Worker echo ids are idbase + instance, they must not wrap. */
+	if (sc->sc_icmp_idbase + sc->sc_icmp_workers > UINT16_MAX) {
+		log_warnx("%s: icmp-workers too many for echo id %d",
+		    filename, sc->sc_icmp_idbase);
+		errors++;
+	}
+	/* Every worker needs a share of at least one packet per second. */
+	if (sc->sc_icmp_pps != 0 &&
+	    sc->sc_icmp_pps < (uint32_t) sc->sc_icmp_workers) {
+		log_warnx("%s: icmp-pps must be at least icmp-workers (%d)",
+		    filename, sc->sc_icmp_workers);
+		errors++;
+	}
+	if (sc->sc_icmp_io == ICMP_IO_PACKET &&
+	    sc->sc_icmp_socket != ICMP_SOCKET_RAW) {
+		log_warnx("%s: icmp-io packet needs raw ICMP sockets",
+		    filename);
+		errors++;
+	}
+	if (sc->sc_icmp_io == ICMP_IO_XDP) {
+		/* Datagram sockets rewrite the identifiers it steers on. */
+		if (sc->sc_icmp_socket != ICMP_SOCKET_RAW) {
+			log_warnx("%s: icmp-io xdp needs raw ICMP sockets",
+			    filename);
+			errors++;
+		}
+		if (sc->sc_xdp_ifname == NULL) {
+			log_warnx("%s: icmp-io xdp needs an xdp-interface",
+			    filename);
+			errors++;
+		}
+		/* A single socket receives the replies of all the probes. */
+		if (sc->sc_icmp_workers != 1) {
+			log_warnx("%s: icmp-io xdp needs a single icmp worker",
+			    filename);
+			errors++;
+		}
+	}
+
 	return (errors ? -1 : 0);
 }
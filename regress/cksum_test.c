@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2016 Rafael Zalamena <rzalamena@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Checksum regress: compare every checksum implementation the CPU can
+ * run against a plain reference over all the lengths up to CKSUM_MAXLEN
+ * at every alignment of a 64 byte line, plus a few buffers large enough
+ * to spill the vector accumulators. With -b measure their throughput.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The vectorized versions are static. */
+#include "../cksum.c"
+
+#define CKSUM_MAXLEN (2048)
+#define CKSUM_ALIGNS (64)
+/* More than CKSUM_SIMD_ROUNDS iterations of the widest vector loop. */
+#define CKSUM_BIGLEN (CKSUM_SIMD_ROUNDS * 32 * 3 + 7)
+/* in_cksum_scalar() has an int accumulator, it is only good up to this. */
+#define CKSUM_SCALAR_MAXLEN (65535)
+
+struct cksum_impl {
+	const char *ci_name;
+	int (*ci_func)(const uint16_t *, int);
+	int ci_maxlen;
+};
+
+static struct cksum_impl impls[8];
+static int nimpls;
+
+/* Reference: a 64 bit accumulator of the words in memory order. */
+static int
+cksum_ref(const u_char *p, int len)
+{
+	uint64_t sum = 0;
+	uint16_t w;
+
+	for (; len > 1; len -= 2, p += 2) {
+		memcpy(&w, p, sizeof(w));
+		sum += w;
+	}
+	if (len == 1) {
+		w = 0;
+		*(u_char *) &w = *p;
+		sum += w;
+	}
+
+	while (sum >> 16)
+		sum = (sum >> 16) + (sum & 0xffff);
+
+	return ((uint16_t) ~sum);
+}
+
+static void
+impl_add(const char *name, int (*func)(const uint16_t *, int), int maxlen)
+{
+	impls[nimpls].ci_name = name;
+	impls[nimpls].ci_func = func;
+	impls[nimpls].ci_maxlen = maxlen;
+	nimpls++;
+}
+
+static void
+impl_init(void)
+{
+	impl_add("scalar", in_cksum_scalar, CKSUM_SCALAR_MAXLEN);
+#ifdef CKSUM_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		impl_add("sse2", in_cksum_sse2, CKSUM_BIGLEN);
+	if (__builtin_cpu_supports("avx2"))
+		impl_add("avx2", in_cksum_avx2, CKSUM_BIGLEN);
+#endif /* CKSUM_X86 */
+	impl_add("in_cksum", in_cksum, CKSUM_BIGLEN);
+}
+
+/* Check all the implementations on `len` bytes at `p`, 0 if they agree. */
+static int
+check_one(const char *what, const u_char *p, int len)
+{
+	int i, ref, got, errors = 0;
+
+	ref = cksum_ref(p, len);
+	for (i = 0; i < nimpls; i++) {
+		if (len > impls[i].ci_maxlen)
+			continue;
+
+		got = impls[i].ci_func((const uint16_t *) p, len);
+		if (got == ref)
+			continue;
+
+		printf("FAIL %s %s: len %d align %lu: got %#06x want %#06x\n",
+		    impls[i].ci_name, what, len,
+		    (unsigned long) ((uintptr_t) p % CKSUM_ALIGNS), got, ref);
+		errors++;
+	}
+
+	return (errors);
+}
+
+static int
+check_all(u_char *buf)
+{
+	int len, align, errors = 0;
+	size_t i;
+
+	/* Random words, then all ones for the worst case carries. */
+	for (i = 0; i < CKSUM_BIGLEN + CKSUM_ALIGNS; i++)
+		buf[i] = random();
+	for (len = 0; len <= CKSUM_MAXLEN; len++)
+		for (align = 0; align < CKSUM_ALIGNS; align++)
+			errors += check_one("random", buf + align, len);
+	for (align = 0; align < CKSUM_ALIGNS; align += 7) {
+		errors += check_one("random", buf + align,
+		    CKSUM_SCALAR_MAXLEN);
+		errors += check_one("random", buf + align, CKSUM_BIGLEN);
+	}
+
+	memset(buf, 0xff, CKSUM_BIGLEN + CKSUM_ALIGNS);
+	for (len = 0; len <= CKSUM_MAXLEN; len++)
+		errors += check_one("ones", buf + (len % CKSUM_ALIGNS), len);
+	for (align = 0; align < CKSUM_ALIGNS; align += 7) {
+		errors += check_one("ones", buf + align,
+		    CKSUM_SCALAR_MAXLEN);
+		errors += check_one("ones", buf + align, CKSUM_BIGLEN);
+	}
+
+	return (errors);
+}
+
+/* Print the throughput of every implementation on a few packet sizes. */
+static void
+bench_all(u_char *buf)
+{
+	static const int sizes[] = { 20, 64, 576, 1500, 9000, 65535 };
+	volatile int sink = 0;
+	uint64_t start, elapsed, bytes;
+	int i, j, n, rounds;
+
+	for (i = 0; i < CKSUM_BIGLEN + CKSUM_ALIGNS; i++)
+		buf[i] = random();
+
+	printf("%-10s %8s %12s %10s\n", "impl", "bytes", "ns/call", "MB/s");
+	for (i = 0; i < nimpls; i++) {
+		for (j = 0; j < (int) NOF(sizeof(sizes), sizeof(sizes[0]));
+		    j++) {
+			/* About 256 MB per measure, at least 1000 calls. */
+			rounds = MAX((256 << 20) / sizes[j], 1000);
+			start = mono_ns();
+			for (n = 0; n < rounds; n++)
+				sink += impls[i].ci_func(
+				    (const uint16_t *) (buf + (n & 1)),
+				    sizes[j]);
+			elapsed = mono_ns() - start;
+			bytes = (uint64_t) rounds * sizes[j];
+			printf("%-10s %8d %12.2f %10.0f\n", impls[i].ci_name,
+			    sizes[j], (double) elapsed / rounds,
+			    bytes / (elapsed / 1e9) / 1e6);
+		}
+	}
+}
+
+static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-b]\n", __progname);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	u_char *buf;
+	unsigned seed = time(NULL);
+	int ch, bench = 0, errors;
+
+	while ((ch = getopt(argc, argv, "b")) != -1) {
+		switch (ch) {
+		case 'b':
+			bench = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	log_init(1);
+	srandom(seed);
+	impl_init();
+	if ((buf = malloc(CKSUM_BIGLEN + CKSUM_ALIGNS * 2)) == NULL)
+		fatal("malloc");
+	/* Make sure the alignments are relative to a cache line. */
+	buf += CKSUM_ALIGNS - ((uintptr_t) buf % CKSUM_ALIGNS);
+
+	if (bench) {
+		bench_all(buf);
+		return (0);
+	}
+
+	errors = check_all(buf);
+	printf("cksum: %d implementations, seed %u, %s\n", nimpls, seed,
+	    errors ? "FAILED" : "ok");
+
+	return (errors ? 1 : 0);
+}
@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2016 Rafael Zalamena <rzalamena@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Name resolution regress: the probe names are resolved against a stub
+ * DNS server on a local UDP socket serving canned answers, then the
+ * address updates sent to the workers and the refresh timers are checked:
+ * TTL clamping, the AAAA fallback, the retry after a failure or a broken
+ * server, and round robin answers not moving the probes around.
+ */
+
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <event2/dns.h>
+#include <event2/dns_struct.h>
+
+/* The name cache and its timers are static. */
+#include "../dns.c"
+
+#define STUB_MAXADDRS (4)
+
+struct serverstatd_conf sc;
+
+/* Canned answer of the stub server, `sa_addrs` are literals. */
+struct stub_answer {
+	const char *sa_name;
+	int sa_type; /* EVDNS_TYPE_A or EVDNS_TYPE_AAAA */
+	int sa_rcode;
+	const char *sa_addrs[STUB_MAXADDRS];
+	int sa_ttl;
+	int sa_queries; /* how many times it was asked */
+};
+
+static struct stub_answer answers[] = {
+	{ "short.test", EVDNS_TYPE_A, 0, { "192.0.2.1" }, 1 },
+	{ "long.test", EVDNS_TYPE_A, 0, { "192.0.2.2" }, 86400 },
+	{ "v6only.test", EVDNS_TYPE_A, 0, { NULL }, 300 },
+	{ "v6only.test", EVDNS_TYPE_AAAA, 0, { "2001:db8::1" }, 300 },
+	{ "fail.test", EVDNS_TYPE_A, DNS_ERR_NOTEXIST, { NULL }, 0 },
+	{ "fail.test", EVDNS_TYPE_AAAA, DNS_ERR_NOTEXIST, { NULL }, 0 },
+	/* libevent reports it as a timeout, no AAAA query. */
+	{ "servfail.test", EVDNS_TYPE_A, DNS_ERR_SERVERFAILED, { NULL }, 0 },
+	{ "servfail.test", EVDNS_TYPE_AAAA, 0, { "2001:db8::2" }, 300 },
+	{ "rr.test", EVDNS_TYPE_A, 0, { "192.0.2.10", "192.0.2.11" }, 60 },
+};
+
+/* Last address sent to the workers for each host. */
+#define TEST_HOSTS (6)
+static struct sockaddr_storage updates[TEST_HOSTS];
+static int nupdates[TEST_HOSTS];
+
+static int failures;
+
+/* Stub of the parent: record the address instead of sending it. */
+int
+compose_to_worker(uint32_t index, uint32_t type, const void *data,
+    uint16_t datalen)
+{
+	const struct icmp_host_address *iha = data;
+
+	if (type != IMSG_HOST_ADDRESS || datalen != sizeof(*iha) ||
+	    index >= TEST_HOSTS)
+		fatalx("%s: unexpected message", __FUNCTION__);
+
+	memcpy(&updates[index], &iha->iha_ss, sizeof(updates[index]));
+	nupdates[index]++;
+	return (0);
+}
+
+static struct stub_answer *
+stub_find(const char *name, int type)
+{
+	size_t i;
+
+	for (i = 0; i < NOF(sizeof(answers), sizeof(answers[0])); i++)
+		if (strcasecmp(answers[i].sa_name, name) == 0 &&
+		    answers[i].sa_type == type)
+			return (&answers[i]);
+
+	return (NULL);
+}
+
+static void
+stub_server(struct evdns_server_request *req, void *arg)
+{
+	struct evdns_server_question *q;
+	struct stub_answer *sa;
+	struct in_addr in[STUB_MAXADDRS];
+	struct in6_addr in6[STUB_MAXADDRS];
+	int i, n, rcode = DNS_ERR_NOTEXIST;
+
+	for (i = 0; i < req->nquestions; i++) {
+		q = req->questions[i];
+		if ((sa = stub_find(q->name, q->type)) == NULL)
+			continue;
+
+		sa->sa_queries++;
+		rcode = sa->sa_rcode;
+		for (n = 0; n < STUB_MAXADDRS && sa->sa_addrs[n] != NULL; n++) {
+			if (sa->sa_type == EVDNS_TYPE_AAAA)
+				inet_pton(AF_INET6, sa->sa_addrs[n], &in6[n]);
+			else
+				inet_pton(AF_INET, sa->sa_addrs[n], &in[n]);
+		}
+		if (n == 0)
+			continue;
+
+		if (sa->sa_type == EVDNS_TYPE_AAAA)
+			evdns_server_request_add_aaaa_reply(req, q->name, n,
+			    in6, sa->sa_ttl);
+		else
+			evdns_server_request_add_a_reply(req, q->name, n, in,
+			    sa->sa_ttl);
+	}
+
+	evdns_server_request_respond(req, rcode);
+}
+
+/* Start the stub server, returns its address for the configuration. */
+static char *
+stub_init(struct event_base *eb)
+{
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+	static char addr[32];
+	int s;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((s = socket(AF_INET, SOCK_DGRAM, 0)) == -1 ||
+	    bind(s, (struct sockaddr *) &sin, sizeof(sin)) == -1 ||
+	    getsockname(s, (struct sockaddr *) &sin, &slen) == -1 ||
+	    evutil_make_socket_nonblocking(s) == -1)
+		fatal("%s: socket", __FUNCTION__);
+
+	if (evdns_add_server_port_with_base(eb, s, 0, stub_server,
+	    NULL) == NULL)
+		fatalx("%s: evdns_add_server_port_with_base", __FUNCTION__);
+
+	snprintf(addr, sizeof(addr), "127.0.0.1:%d", ntohs(sin.sin_port));
+
+	return (addr);
+}
+
+static void
+host_add(uint32_t index, const char *name)
+{
+	struct icmp_host *ih;
+
+	if ((ih = new_ih(index)) == NULL)
+		fatalx("new_ih");
+	ih->ih_name = ih->ih_address = strdup(name);
+	TAILQ_INSERT_HEAD(&sc.sc_ihlist, ih, ih_entry);
+}
+
+static struct dns_name *
+name_find(const char *name)
+{
+	struct dns_name *dn;
+
+	TAILQ_FOREACH(dn, &dnlist, dn_entry)
+		if (strcmp(dn->dn_name, name) == 0)
+			return (dn);
+
+	fatalx("%s: no cache entry for %s", __FUNCTION__, name);
+	return (NULL);
+}
+
+/* Seconds until the refresh of the name, -1 if none is scheduled. */
+static int
+name_refresh_in(const char *name)
+{
+	struct dns_name *dn = name_find(name);
+	struct timeval tv, now;
+
+	if (!evtimer_pending(dn->dn_ev, &tv))
+		return (-1);
+
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&tv, &now, &tv);
+	/* Rounded, the timer was started a moment ago. */
+	return (tv.tv_sec + (tv.tv_usec >= 500000));
+}
+
+/* Run the loop until no query is outstanding or for two seconds. */
+static void
+loop_idle(struct event_base *eb)
+{
+	struct dns_name *dn;
+	struct timeval deadline, now;
+	int busy;
+
+	evutil_gettimeofday(&deadline, NULL);
+	deadline.tv_sec += 2;
+	do {
+		event_base_loop(eb, EVLOOP_ONCE | EVLOOP_NONBLOCK);
+		busy = 0;
+		TAILQ_FOREACH(dn, &dnlist, dn_entry)
+			if (dn->dn_req != NULL)
+				busy = 1;
+		evutil_gettimeofday(&now, NULL);
+		if (busy)
+			usleep(1000);
+	} while (busy && evutil_timercmp(&now, &deadline, <));
+}
+
+static void
+check(int ok, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (ok)
+		return;
+
+	failures++;
+	printf("FAIL ");
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+}
+
+/* Host `index` got `count` updates, the last one to `addr`. */
+static void
+check_update(uint32_t index, int count, const char *addr)
+{
+	struct sockaddr_storage ss;
+
+	check(nupdates[index] == count, "host %u: %d updates, want %d",
+	    index, nupdates[index], count);
+	if (addr == NULL)
+		return;
+
+	ih_address_parse(addr, &ss);
+	check(ih_address_cmp(&updates[index], &ss) == 0,
+	    "host %u: wrong address, want %s", index, addr);
+}
+
+static void
+check_refresh(const char *name, int secs)
+{
+	int in = name_refresh_in(name);
+
+	check(in == secs, "%s: refresh in %d seconds, want %d", name, in,
+	    secs);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct event_base *eb;
+	struct stub_answer *sa;
+
+	log_init(1);
+	if ((eb = event_base_new()) == NULL)
+		fatalx("event_base_new");
+
+	TAILQ_INIT(&sc.sc_ihlist);
+	sc.sc_nameservers[sc.sc_nameservercount++] = stub_init(eb);
+	host_add(0, "short.test");
+	host_add(1, "long.test");
+	host_add(2, "v6only.test");
+	host_add(3, "fail.test");
+	host_add(4, "rr.test");
+	host_add(5, "servfail.test");
+	/* A literal address is never resolved. */
+	host_add(TEST_HOSTS, "192.0.2.99");
+
+	dns_init(eb);
+	loop_idle(eb);
+
+	/* TTLs are clamped. */
+	check_update(0, 1, "192.0.2.1");
+	check_refresh("short.test", DNS_TTL_MIN);
+	check_update(1, 1, "192.0.2.2");
+	check_refresh("long.test", DNS_TTL_MAX);
+
+	/* No A records, the AAAA query follows. */
+	check_update(2, 1, "2001:db8::1");
+	check_refresh("v6only.test", 300);
+
+	/* Both queries failed: no address, retried later. */
+	check_update(3, 0, NULL);
+	check_refresh("fail.test", DNS_RETRY);
+	check(stub_find("fail.test", EVDNS_TYPE_AAAA)->sa_queries == 1,
+	    "fail.test: no AAAA fallback");
+
+	/* A broken server is not a missing record, just retry. */
+	check_update(5, 0, NULL);
+	check_refresh("servfail.test", DNS_RETRY);
+	check(stub_find("servfail.test", EVDNS_TYPE_AAAA)->sa_queries == 0,
+	    "servfail.test: AAAA fallback");
+
+	/* The first address of a round robin answer. */
+	check_update(4, 1, "192.0.2.10");
+	check_refresh("rr.test", 60);
+
+	/* The retry gets the address once the server recovers. */
+	sa = stub_find("fail.test", EVDNS_TYPE_A);
+	sa->sa_rcode = 0;
+	sa->sa_addrs[0] = "192.0.2.4";
+	sa->sa_ttl = 30;
+	event_active(name_find("fail.test")->dn_ev, EV_TIMEOUT, 1);
+	loop_idle(eb);
+	check_update(3, 1, "192.0.2.4");
+	check_refresh("fail.test", 30);
+
+	/* The rotated answer still has our address, the probes stay. */
+	sa = stub_find("rr.test", EVDNS_TYPE_A);
+	sa->sa_addrs[0] = "192.0.2.11";
+	sa->sa_addrs[1] = "192.0.2.10";
+	event_active(name_find("rr.test")->dn_ev, EV_TIMEOUT, 1);
+	loop_idle(eb);
+	check(sa->sa_queries == 2, "rr.test: not refreshed");
+	check_update(4, 1, "192.0.2.10");
+
+	/* Our address left the answer, move to the new first one. */
+	sa->sa_addrs[0] = "192.0.2.12";
+	sa->sa_addrs[1] = "192.0.2.11";
+	event_active(name_find("rr.test")->dn_ev, EV_TIMEOUT, 1);
+	loop_idle(eb);
+	check_update(4, 2, "192.0.2.12");
+
+	printf("dns: %s\n", failures ? "FAILED" : "ok");
+	return (failures ? 1 : 0);
+}
@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2016 Rafael Zalamena <rzalamena@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Reply demultiplexing benchmark: the cost of matching a reply to its
+ * host and in-flight probe, from 100 to 100k hosts, in random order so
+ * the bigger tables pay their cache misses. The host list walk the
+ * lookup tables replaced is measured too, for comparison.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "serverstatd.h"
+
+/* Probes in flight per host. */
+#define BENCH_INFLIGHT (4)
+#define BENCH_REPLIES (1 << 20)
+
+struct serverstatd_conf sc;
+
+struct bench_reply {
+	uint32_t br_index;
+	uint32_t br_cookie;
+	uint16_t br_seq;
+	struct in_addr br_addr;
+};
+
+/* The configuration list walk, how replies used to be matched. */
+static struct icmp_host *
+find_ih_list(uint32_t index)
+{
+	struct icmp_host *ih;
+
+	TAILQ_FOREACH(ih, &sc.sc_ihlist, ih_entry)
+		if (ih->ih_index == index)
+			return (ih);
+
+	return (NULL);
+}
+
+/* Configure `count` hosts with a few probes in flight each. */
+static struct icmp_host **
+hosts_init(uint32_t count)
+{
+	struct icmp_host **hosts, *ih;
+	char buf[IH_TMPL_LEN], addr[INET_ADDRSTRLEN];
+	uint32_t i;
+	int n;
+
+	TAILQ_INIT(&sc.sc_ihlist);
+	if ((hosts = calloc(count, sizeof(*hosts))) == NULL)
+		fatal("calloc");
+
+	for (i = 0; i < count; i++) {
+		if ((ih = new_ih(i)) == NULL)
+			fatalx("new_ih");
+		snprintf(addr, sizeof(addr), "10.%u.%u.%u", (i >> 16) & 0xff,
+		    (i >> 8) & 0xff, i & 0xff);
+		ih_address_parse(addr, &ih->ih_ss);
+		ih->ih_id = 1;
+		ih->ih_seq = random();
+		TAILQ_INSERT_HEAD(&sc.sc_ihlist, ih, ih_entry);
+		hosts[i] = ih;
+	}
+	sc.sc_ihcount = count;
+
+	if (ih_table_init(0, count) == -1 || ih_addr_table_init() == -1 ||
+	    ih_ipring_init() == -1)
+		fatalx("lookup tables");
+
+	for (i = 0; i < count; i++) {
+		ih_tmpl_init(hosts[i]);
+		for (n = 0; n < BENCH_INFLIGHT; n++)
+			new_ip(hosts[i], buf, sizeof(buf));
+	}
+
+	return (hosts);
+}
+
+static void
+hosts_free(struct icmp_host **hosts, uint32_t count)
+{
+	uint32_t i;
+
+	/* The rings slab starts with the first host of the list. */
+	free(TAILQ_FIRST(&sc.sc_ihlist)->ih_ipring);
+	for (i = 0; i < count; i++)
+		free(hosts[i]);
+	free(hosts);
+}
+
+/* Replies to random hosts and random probes in flight. */
+static void
+replies_init(struct bench_reply *br, struct icmp_host **hosts, uint32_t count)
+{
+	struct icmp_host *ih;
+	int i;
+
+	for (i = 0; i < BENCH_REPLIES; i++) {
+		ih = hosts[random() % count];
+		br[i].br_index = ih->ih_index;
+		br[i].br_cookie = ih->ih_cookie;
+		br[i].br_seq = ih->ih_seq - 1 - (random() % BENCH_INFLIGHT);
+		br[i].br_addr = sstosin(&ih->ih_ss)->sin_addr;
+	}
+}
+
+/* Match `n` replies like icmp_recv() does, returns ns per reply. */
+static double
+bench_match(struct bench_reply *br, int n,
+    struct icmp_host *(*lookup)(uint32_t))
+{
+	struct icmp_host *ih;
+	uint64_t start;
+	int i, matched = 0;
+
+	start = mono_ns();
+	for (i = 0; i < n; i++) {
+		if ((ih = lookup(br[i].br_index)) == NULL ||
+		    ih->ih_cookie != br[i].br_cookie)
+			continue;
+		if (find_ip(ih, br[i].br_seq) != NULL)
+			matched++;
+	}
+	if (matched != n)
+		fatalx("only %d of %d replies matched", matched, n);
+
+	return ((double) (mono_ns() - start) / n);
+}
+
+/* Match `n` ICMP errors by the quoted address, returns ns per error. */
+static double
+bench_addr(struct bench_reply *br, int n)
+{
+	struct icmp_host *ih;
+	uint64_t start;
+	int i, matched = 0;
+
+	start = mono_ns();
+	for (i = 0; i < n; i++) {
+		if ((ih = find_ih_addr(AF_INET, &br[i].br_addr)) == NULL)
+			continue;
+		if (find_ip(ih, br[i].br_seq) != NULL)
+			matched++;
+	}
+	if (matched != n)
+		fatalx("only %d of %d errors matched", matched, n);
+
+	return ((double) (mono_ns() - start) / n);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const uint32_t counts[] = { 100, 1000, 10000, 100000 };
+	struct icmp_host **hosts;
+	struct bench_reply *br;
+	uint32_t count;
+	int i, nlist;
+
+	log_init(1);
+	srandom(time(NULL));
+	if (getentropy(sc.sc_icmp_key, sizeof(sc.sc_icmp_key)) == -1)
+		fatal("getentropy");
+	if ((br = calloc(BENCH_REPLIES, sizeof(*br))) == NULL)
+		fatal("calloc");
+
+	printf("%8s %12s %12s %12s\n", "hosts", "index ns", "address ns",
+	    "list ns");
+	for (i = 0; i < (int) NOF(sizeof(counts), sizeof(counts[0])); i++) {
+		count = counts[i];
+		hosts = hosts_init(count);
+		replies_init(br, hosts, count);
+
+		/* The list walk is linear, keep its total work bounded. */
+		nlist = MIN(BENCH_REPLIES, MAX(1000, (1 << 28) / count));
+		printf("%8u %12.1f %12.1f %12.1f\n", count,
+		    bench_match(br, BENCH_REPLIES, find_ih),
+		    bench_addr(br, BENCH_REPLIES),
+		    bench_match(br, nlist, find_ih_list));
+
+		hosts_free(hosts, count);
+	}
+
+	return (0);
+}
@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2016 Rafael Zalamena <rzalamena@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Loss window regress: drive the loss bitmap with hand made send and
+ * reply sequences and check the counters, the window loss percentage and
+ * the jitter against values computed by hand: missing and reordered
+ * replies, duplicates, replies arriving after the window moved past
+ * them, the 16 bit sequence wrap and the RFC 3550 jitter update.
+ */
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "serverstatd.h"
+
+struct serverstatd_conf sc;
+
+static int failures;
+
+static void
+check(int ok, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (ok)
+		return;
+
+	failures++;
+	printf("FAIL ");
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+}
+
+static void
+check_pct(const struct loss_stats *ls, double pct, const char *what)
+{
+	double got = loss_window_pct(ls);
+
+	check(fabs(got - pct) < 1e-9, "%s: loss %.4f%%, expected %.4f%%",
+	    what, got, pct);
+}
+
+/* Send `count` probes, the sequence is the send counter. */
+static void
+send_n(struct loss_stats *ls, int count)
+{
+	while (count--)
+		loss_sent(ls);
+}
+
+/* Missing, reordered and duplicated replies in a stateful window. */
+static void
+test_window(void)
+{
+	struct loss_stats ls;
+	uint16_t seq;
+
+	memset(&ls, 0, sizeof(ls));
+	ls.ls_size = IH_IPSLOTS;
+
+	check(loss_recv(&ls, 0) == LOSS_LATE, "reply before any probe");
+	ls.ls_late = 0;
+	check_pct(&ls, 0, "empty window");
+
+	/* 10 probes, 3 and 7 unanswered, 9 answered before 8. */
+	send_n(&ls, 10);
+	for (seq = 0; seq < 8; seq++) {
+		if (seq == 3 || seq == 7)
+			continue;
+		check(loss_recv(&ls, seq) == LOSS_NEW, "seq %d not new", seq);
+	}
+	check(ls.ls_reordered == 0, "in order replies reordered");
+	check(loss_recv(&ls, 9) == LOSS_NEW, "seq 9 not new");
+	check(loss_recv(&ls, 8) == LOSS_NEW, "seq 8 not new");
+	check(ls.ls_reordered == 1, "reordered %llu, expected 1",
+	    (unsigned long long) ls.ls_reordered);
+	check(ls.ls_received == 8, "received %llu, expected 8",
+	    (unsigned long long) ls.ls_received);
+
+	/* The last probe is left out: 2 lost out of 9. */
+	check_pct(&ls, 200.0 / 9, "two missing");
+
+	check(loss_recv(&ls, 0) == LOSS_DUP, "seq 0 not a duplicate");
+	check(ls.ls_dup == 1 && ls.ls_received == 8,
+	    "duplicate counted as received");
+
+	/* 16 more: probes 0 to 9 leave the window, 3 and 7 are lost. */
+	send_n(&ls, 16);
+	check(ls.ls_lost == 2, "lost %llu, expected 2",
+	    (unsigned long long) ls.ls_lost);
+	check_pct(&ls, 100, "nothing answered");
+
+	/* Too late for the window, not received nor lost again. */
+	check(loss_recv(&ls, 3) == LOSS_LATE, "seq 3 not late");
+	check(loss_recv(&ls, 9) == LOSS_LATE, "seq 9 not late");
+	check(ls.ls_late == 2 && ls.ls_received == 8 && ls.ls_lost == 2,
+	    "late replies miscounted");
+
+	/* The oldest probe still in the window is not late. */
+	check(loss_recv(&ls, 10) == LOSS_NEW, "seq 10 not new");
+	check_pct(&ls, 1400.0 / 15, "oldest answered");
+	send_n(&ls, 1);
+	check(ls.ls_lost == 2, "answered probe counted lost");
+}
+
+/* Sequences wrap at 16 bits, the send counter does not. */
+static void
+test_wrap(void)
+{
+	struct loss_stats ls;
+	uint32_t n;
+
+	memset(&ls, 0, sizeof(ls));
+	ls.ls_size = LOSS_WINDOW;
+
+	for (n = 0; n < 65530; n++) {
+		loss_sent(&ls);
+		loss_recv(&ls, (uint16_t) n);
+	}
+	check(ls.ls_received == 65530 && ls.ls_lost == 0 &&
+	    ls.ls_late == 0 && ls.ls_dup == 0, "before the wrap");
+
+	/* 65530 to 65535 then 0 to 3. */
+	send_n(&ls, 10);
+	check(loss_recv(&ls, 2) == LOSS_NEW, "seq 2 not new");
+	check(loss_recv(&ls, 65534) == LOSS_NEW, "seq 65534 not new");
+	check(ls.ls_window == ((1ULL << 1) | (1ULL << 5) |
+	    (~0ULL << 10)), "window %#llx", (unsigned long long) ls.ls_window);
+	check(ls.ls_reordered == 1, "reordered %llu, expected 1",
+	    (unsigned long long) ls.ls_reordered);
+	check(loss_recv(&ls, 2) == LOSS_DUP, "seq 2 not a duplicate");
+
+	/* 7 of the 9 probes before the last are missing. */
+	check_pct(&ls, 7 * 100.0 / 63, "across the wrap");
+
+	/* Probe 65529 (age 10) and older ones were answered. */
+	check(loss_recv(&ls, 65529) == LOSS_DUP, "seq 65529 not a duplicate");
+
+	/* Window full of the wrapped sequences: seq 4 was never sent. */
+	check(loss_recv(&ls, 4) == LOSS_LATE, "unsent seq 4 accepted");
+}
+
+/* RFC 3550: J += (|D| - J) / 16, starting with the second reply. */
+static void
+test_jitter(void)
+{
+	struct loss_stats ls;
+	static const uint64_t rtts[] = { 10000000, 14000000, 8000000,
+	    8000000 };
+	/* 0, 4ms / 16, then + (6ms - J) / 16 and - J / 16. */
+	static const double jitter[] = { 0, 250000, 609375, 571289.0625 };
+	uint16_t seq;
+
+	memset(&ls, 0, sizeof(ls));
+	ls.ls_size = LOSS_WINDOW;
+
+	for (seq = 0; seq < sizeof(rtts) / sizeof(rtts[0]); seq++) {
+		loss_sent(&ls);
+		loss_recv(&ls, seq);
+		loss_rtt(&ls, rtts[seq]);
+		check(fabs(ls.ls_jitter - jitter[seq]) < 1e-6,
+		    "jitter %.4f after reply %d, expected %.4f",
+		    ls.ls_jitter, seq, jitter[seq]);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	log_init(1);
+
+	test_window();
+	test_wrap();
+	test_jitter();
+
+	printf("loss: %s\n", failures ? "FAILED" : "ok");
+	return (failures ? 1 : 0);
+}
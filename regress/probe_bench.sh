@@ -0,0 +1,224 @@
+#!/bin/sh
+#
+# Copyright (c) 2016 Rafael Zalamena <rzalamena@gmail.com>
+#
+# Permission to use, copy, modify, and/or distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+
+#
+# Probe throughput benchmark (Linux, needs root).
+#
+# The hosts live in a network namespace behind a veth pair, the namespace
+# answers for all of 10.98.0.0/16. With enough hosts and a short interval
+# the daemon is saturated: probes/s is how fast it sends, replies/s how
+# many of the replies it could read, the rest overflowed the socket. With
+# -p the load is paced instead, to compare the cost per probe. For every
+# probe I/O backend and worker count the benchmark runs the daemon, waits
+# for it to settle, and reports:
+#
+#	probes/s	echo requests received by the namespace (kernel counter)
+#	replies/s	replies the workers received (SIGUSR1 before and after,
+#			XDP steered replies never reach the kernel counters)
+#	cpu us/probe	worker CPU time per probe (/proc)
+#	tx/rx sys/pkt	system calls per packet, as counted by the workers
+#
+
+usage() {
+	echo "usage: $0 [-n hosts] [-i interval-ms] [-t seconds]" \
+	    "[-p pps] [-w \"workers ...\"] [-o \"icmp-io ...\"]" \
+	    "[-d serverstatd]" >&2
+	exit 1
+}
+
+HOSTS=8192
+INTERVAL=10
+PPS=0
+SECONDS_RUN=10
+WORKERS="1 2 4"
+# Backends the daemon was built with, e.g. -o "event io_uring xdp".
+IOS="event"
+DAEMON=../serverstatd
+
+NS=ssbench
+IF=ssb0
+PEER=ssb1
+WORK=$(mktemp -d /tmp/probe_bench.XXXXXX)
+
+while getopts "n:i:t:p:w:o:d:" opt; do
+	case $opt in
+	n) HOSTS=$OPTARG ;;
+	i) INTERVAL=$OPTARG ;;
+	t) SECONDS_RUN=$OPTARG ;;
+	p) PPS=$OPTARG ;;
+	w) WORKERS=$OPTARG ;;
+	o) IOS=$OPTARG ;;
+	d) DAEMON=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+
+[ "$(id -u)" -eq 0 ] || { echo "$0: needs root" >&2; exit 1; }
+[ -x "$DAEMON" ] || { echo "$0: $DAEMON not built" >&2; exit 1; }
+[ "$HOSTS" -le 63500 ] || { echo "$0: at most 63500 hosts" >&2; exit 1; }
+
+DPID=
+
+cleanup() {
+	# Only the daemon we started, not any other one on the machine.
+	[ -n "$DPID" ] && kill -TERM "$DPID" 2>/dev/null
+	ip link del $IF 2>/dev/null
+	ip netns del $NS 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+netns_setup() {
+	ip netns add $NS || exit 1
+	ip link add $IF type veth peer name $PEER || exit 1
+	ip link set $PEER netns $NS
+	ip addr add 10.97.0.1/30 dev $IF
+	ip link set $IF up
+	ip -n $NS addr add 10.97.0.2/30 dev $PEER
+	ip -n $NS link set $PEER up
+	ip -n $NS link set lo up
+	# Route the hosts through the peer, so no neighbor resolution.
+	ip route add 10.98.0.0/16 via 10.97.0.2
+	ip -n $NS route add local 10.98.0.0/16 dev lo
+}
+
+# conf_write workers [extra configuration]
+conf_write() {
+	{
+		echo "user \"nobody\""
+		echo "chroot \"$WORK/empty\""
+		echo "icmp-workers $1"
+		[ "$PPS" -gt 0 ] && echo "icmp-pps $PPS"
+		[ -n "$2" ] && echo "$2"
+		i=0
+		while [ $i -lt "$HOSTS" ]; do
+			echo "icmp-probe {"
+			echo "name \"h$i\""
+			echo "address \"10.98.$((1 + i / 250)).$((1 + i % 250))\""
+			echo "interval ${INTERVAL}ms"
+			# Hosts whose first reply got lost keep the pace.
+			echo "down-interval ${INTERVAL}ms"
+			echo "}"
+			i=$((i + 1))
+		done
+	} > "$WORK/bench.conf"
+}
+
+# icmp_counter [netns] name: an Icmp counter of /proc/net/snmp.
+icmp_counter() {
+	eval name=\${$#}
+	if [ $# -eq 2 ]; then
+		ip netns exec "$1" cat /proc/net/snmp
+	else
+		cat /proc/net/snmp
+	fi | awk -v name="$name" '
+		$1 == "Icmp:" && !header { for (i = 2; i <= NF; i++)
+			if ($i == name) col = i; header = 1; next }
+		$1 == "Icmp:" && header { print $col; exit }'
+}
+
+# worker_ticks pid: CPU clock ticks of the children of the daemon.
+worker_ticks() {
+	ticks=0
+	for stat in /proc/[0-9]*/stat; do
+		set -- $(cat "$stat" 2>/dev/null)
+		[ "$4" = "$DPID" ] && ticks=$((ticks + ${14} + ${15}))
+	done
+	echo $ticks
+}
+
+# run label workers [extra configuration]
+run() {
+	label=$1
+	conf_write "$2" "$3"
+	"$DAEMON" -d -f "$WORK/bench.conf" > "$WORK/log" 2>&1 &
+	DPID=$!
+
+	# Let the hosts come up and the schedule spread.
+	sleep 3
+	if ! kill -0 $DPID 2>/dev/null; then
+		echo "$label: daemon failed to start:" >&2
+		tail -5 "$WORK/log" >&2
+		DPID=
+		return
+	fi
+
+	pkill -USR1 -P $DPID
+	req0=$(icmp_counter $NS InEchos)
+	cpu0=$(worker_ticks)
+	t0=$(date +%s%N)
+	sleep "$SECONDS_RUN"
+	pkill -USR1 -P $DPID
+	req1=$(icmp_counter $NS InEchos)
+	cpu1=$(worker_ticks)
+	t1=$(date +%s%N)
+
+	sleep 1
+	kill -TERM $DPID
+	wait $DPID 2>/dev/null
+	DPID=
+
+	# Every worker logged its counters twice, the second half is the end.
+	awk -v label="$label" -v w="$2" -v ns=$((t1 - t0)) \
+	    -v req=$((req1 - req0)) -v cpu=$((cpu1 - cpu0)) \
+	    -v hz="$(getconf CLK_TCK)" '
+		/received [0-9]+ packets/ {
+			for (i = 1; i < NF; i++)
+				if ($i == "received")
+					rxpkts[++nrx] = $(i + 1)
+		}
+		/system calls per packet/ {
+			n++
+			for (i = 1; i < NF; i++) {
+				if ($(i + 1) == "send") tx[n] = $i
+				if ($(i + 1) == "receive") rx[n] = $i
+			}
+		}
+		END {
+			for (i = nrx / 2 + 1; i <= nrx; i++)
+				rep += rxpkts[i] - rxpkts[i - nrx / 2]
+			for (i = n / 2 + 1; i <= n; i++) {
+				txs += tx[i]
+				rxs += rx[i]
+			}
+			s = ns / 1e9
+			printf("%-8s %7d %10.0f %10.0f %12.2f %6.2f %6.2f\n",
+			    label, w, req / s, rep / s,
+			    req ? cpu / hz * 1e6 / req : 0,
+			    n ? txs / (n / 2) : 0, n ? rxs / (n / 2) : 0)
+		}' "$WORK/log"
+}
+
+mkdir -p "$WORK/empty"
+netns_setup
+
+echo "$HOSTS hosts every ${INTERVAL} ms, ${SECONDS_RUN} s per run," \
+    "$(nproc) CPUs"
+printf "%-8s %7s %10s %10s %12s %6s %6s\n" "io" "workers" "probes/s" \
+    "replies/s" "cpu us/probe" "tx" "rx"
+for io in $IOS; do
+	for w in $WORKERS; do
+		conf="icmp-io \"$io\""
+		if [ "$io" = xdp ]; then
+			# The XSK is bound to a single queue, a single worker.
+			[ "$w" -eq 1 ] || continue
+			conf="$conf
+xdp-interface \"$IF\""
+		fi
+		run "$io" "$w" "$conf"
+	done
+done
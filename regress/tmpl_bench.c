@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2016 Rafael Zalamena <rzalamena@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Echo request build benchmark: the cost of a probe built from the host
+ * template with an incremental checksum update, against building the
+ * header and summing the whole packet buffer as it used to be done. Every
+ * packet built is checked to carry a valid checksum.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "serverstatd.h"
+
+#define BENCH_PROBES (1 << 22)
+/* The packet buffer every probe used to be summed over. */
+#define BENCH_OLDBUF (1536)
+
+struct serverstatd_conf sc;
+
+/* The old probe build: write the header, then sum the whole buffer. */
+static void
+build_old(struct icmp_host *ih, char *buf,
+    int (*cksum)(const uint16_t *, int))
+{
+	struct icmp *icmp = (struct icmp *) buf;
+
+	icmp->icmp_type = ICMP_ECHO;
+	icmp->icmp_code = 0;
+	icmp->icmp_cksum = 0;
+	icmp->icmp_seq = htons(ih->ih_seq++);
+	icmp->icmp_id = htons(ih->ih_id);
+	icmp->icmp_cksum = cksum((uint16_t *) icmp, BENCH_OLDBUF);
+}
+
+static void
+build_tmpl(struct icmp_host *ih, char *buf)
+{
+	new_ip(ih, buf, BENCH_OLDBUF);
+}
+
+static void
+build_stateless(struct icmp_host *ih, char *buf)
+{
+	new_ip_stateless(ih, buf, BENCH_OLDBUF);
+	ip_stateless_stamp(ih, buf, ih->ih_seq);
+}
+
+static void
+check(const char *what, char *buf)
+{
+	if (in_cksum_scalar((uint16_t *) buf, BENCH_OLDBUF) != 0)
+		fatalx("%s: bad checksum for sequence %u", what,
+		    ntohs(((struct icmp *) buf)->icmp_seq));
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct icmp_host *ih;
+	char *buf;
+	uint64_t start;
+	int i;
+
+	log_init(1);
+	if (getentropy(sc.sc_icmp_key, sizeof(sc.sc_icmp_key)) == -1)
+		fatal("getentropy");
+	if ((buf = calloc(1, BENCH_OLDBUF)) == NULL)
+		fatal("calloc");
+	if ((ih = new_ih(0)) == NULL)
+		fatalx("new_ih");
+	if ((ih->ih_ipring = calloc(IH_IPSLOTS,
+	    sizeof(*ih->ih_ipring))) == NULL)
+		fatal("calloc");
+	ih_address_parse("192.0.2.1", &ih->ih_ss);
+	ih->ih_id = 1;
+	ih_tmpl_init(ih);
+
+	/* Every sequence, so the checksum folding is fully exercised. */
+	for (i = 0; i <= UINT16_MAX; i++) {
+		build_tmpl(ih, buf);
+		check("template", buf);
+		build_stateless(ih, buf);
+		check("stateless", buf);
+	}
+	memset(buf, 0, BENCH_OLDBUF);
+	build_old(ih, buf, in_cksum_scalar);
+	check("rebuild", buf);
+
+	printf("%-24s %10s\n", "build", "ns/probe");
+
+	start = mono_ns();
+	for (i = 0; i < BENCH_PROBES / 16; i++)
+		build_old(ih, buf, in_cksum_scalar);
+	printf("%-24s %10.2f\n", "rebuild, scalar sum",
+	    (double) (mono_ns() - start) / (BENCH_PROBES / 16));
+
+	start = mono_ns();
+	for (i = 0; i < BENCH_PROBES / 16; i++)
+		build_old(ih, buf, in_cksum);
+	printf("%-24s %10.2f\n", "rebuild, in_cksum",
+	    (double) (mono_ns() - start) / (BENCH_PROBES / 16));
+
+	start = mono_ns();
+	for (i = 0; i < BENCH_PROBES; i++)
+		build_tmpl(ih, buf);
+	printf("%-24s %10.2f\n", "template",
+	    (double) (mono_ns() - start) / BENCH_PROBES);
+
+	start = mono_ns();
+	for (i = 0; i < BENCH_PROBES; i++)
+		build_stateless(ih, buf);
+	printf("%-24s %10.2f\n", "template, stateless MAC",
+	    (double) (mono_ns() - start) / BENCH_PROBES);
+
+	return (0);
+}
@@ -42,17 +42,22 @@
 /* Global configuration structure shared between children. */
 struct serverstatd_conf sc;
 
-/* Child worker process declaration */
-struct proc_ctx pcs[1] = {
-	{
-		.pc_name = "icmp probe",
-		.pc_func = icmp_handler,
-		.pc_pid = 0,
-		.pc_sp = { -1, -1 },
-		.pc_ev = NULL,
-		.pc_evout = NULL,
-	},
-};
+/* Child worker processes, one per ICMP probe shard. */
+static struct proc_ctx *pcs;
+static int pcs_count;
+
+/* RTT samples of all the probes, as reported by the workers. */
+static struct rtt_stats main_rtt;
+
+/*
+ * Replies that got to the probes, summed over the worker reports, and
+ * the host ICMP input counter at start: the difference is what the
+ * socket filters dropped, for the whole host.
+ */
+static uint64_t main_inmsgs;
+static int main_inmsgsok;
+static uint64_t main_delivered;
+static int main_reports;
 
 /* Main process signal handlers */
 static void
@@ -63,7 +68,7 @@ main_term_handler(evutil_socket_t s, short ev, void *bula)
 
 	log_info("%s: received signal %d", __FUNCTION__, s);
 
-	for (n = 0; n < NOF(sizeof(pcs), sizeof(pcs[0])); n++) {
+	for (n = 0; n < pcs_count; n++) {
 		if (pcs[n].pc_pid == 0)
 			continue;
 
@@ -79,6 +84,68 @@ main_term_handler(evutil_socket_t s, short ev, void *bula)
 	exit(0);
 }
 
+static void
+main_usr1_handler(evutil_socket_t s, short ev, void *bula)
+{
+	int n;
+
+	main_delivered = 0;
+	main_reports = 0;
+
+	/* Ask children to report their statistics. */
+	for (n = 0; n < pcs_count; n++) {
+		if (pcs[n].pc_pid == 0)
+			continue;
+
+		kill(pcs[n].pc_pid, SIGUSR1);
+	}
+
+	for (n = 0; n < pcs_count; n++)
+		log_info("%s: %llu results in %llu wakeups over shared "
+		    "memory, %llu dropped", pcs[n].pc_name,
+		    (unsigned long long) pcs[n].pc_ringrecords,
+		    (unsigned long long) pcs[n].pc_ringwakeups,
+		    (unsigned long long) __atomic_load_n(
+		    &pcs[n].pc_ring.sr_hdr->sh_dropped, __ATOMIC_RELAXED));
+
+	if (main_rtt.rs_count)
+		log_info("all probes rtt min/avg/max/stddev = "
+		    "%.3f/%.3f/%.3f/%.3f ms, p50 %.3f ms, p99 %.3f ms, "
+		    "%llu samples", main_rtt.rs_min / 1e6,
+		    main_rtt.rs_mean / 1e6, main_rtt.rs_max / 1e6,
+		    rtt_stddev(&main_rtt) / 1e6,
+		    rtt_percentile(&main_rtt, 50) / 1e6,
+		    rtt_percentile(&main_rtt, 99) / 1e6,
+		    (unsigned long long) main_rtt.rs_count);
+}
+
+/*
+ * Log the ICMP messages the host got that never reached the probes: the
+ * ones the socket filters rejected plus the receive queue overflows.
+ */
+static void
+main_icmp_stats(void)
+{
+	uint64_t inmsgs;
+
+	if (!main_inmsgsok || icmp_snmp_inmsgs(&inmsgs) == -1) {
+		log_info("%llu packets reached the probes",
+		    (unsigned long long) main_delivered);
+		return;
+	}
+
+	/*
+	 * XDP takes the replies before the kernel counts them, the probes
+	 * can then get more than the counter says.
+	 */
+	inmsgs -= main_inmsgs;
+	log_info("host-wide: %llu ICMP messages received by the kernel "
+	    "since start, %llu reached the probes, %llu filtered or dropped",
+	    (unsigned long long) inmsgs, (unsigned long long) main_delivered,
+	    (unsigned long long) (inmsgs > main_delivered ?
+	    inmsgs - main_delivered : 0));
+}
+
 static void
 main_hup_handler(evutil_socket_t s, short ev, void *bula)
 {
@@ -90,10 +157,10 @@ static void
 main_dispatcher(evutil_socket_t sd, short ev, void *arg)
 {
 	struct proc_ctx *pc = arg;
-	struct icmp_host *ih;
 	struct imsg imsg;
 	int n;
-	int sraw;
+	int sraw, af;
+	uint64_t delivered;
 
 	if (imsg_read(&pc->pc_ibuf) == -1 && errno != EAGAIN)
 		fatal("%s: imsg_read", __FUNCTION__);
@@ -106,27 +173,96 @@ main_dispatcher(evutil_socket_t sd, short ev, void *arg)
 
 		switch (imsg.hdr.type) {
 		case IMSG_SOCKET_RAW:
-			log_debug("%s: new icmp socket", __FUNCTION__);
-			sraw = icmp_socket();
-			compose_to_child(&pcs[0], IMSG_SOCKET_RAW, sraw, NULL, 0);
+			if ((imsg.hdr.len - IMSG_HEADER_SIZE) != sizeof(af)) {
+				log_warnx("%s: invalid socket request",
+				    __FUNCTION__);
+				break;
+			}
+
+			memcpy(&af, imsg.data, sizeof(af));
+			log_debug("%s: new icmp socket (family %d)",
+			    __FUNCTION__, af);
+			sraw = icmp_socket(af, pc->pc_instance);
+			compose_to_child(pc, IMSG_SOCKET_RAW, sraw, &af,
+			    sizeof(af));
 			break;
-		case IMSG_HOST_UP:
-			ih = imsg.data;
-			log_icmp_host_event(ih, IHS_UP);
+		case IMSG_ICMP_STATS:
+			if ((imsg.hdr.len - IMSG_HEADER_SIZE) !=
+			    sizeof(delivered)) {
+				log_warnx("%s: invalid statistics",
+				    __FUNCTION__);
+				break;
+			}
+
+			memcpy(&delivered, imsg.data, sizeof(delivered));
+			main_delivered += delivered;
+			if (++main_reports == pcs_count)
+				main_icmp_stats();
 			break;
-		case IMSG_HOST_DOWN:
-			ih = imsg.data;
-			log_icmp_host_event(ih, IHS_DOWN);
+		case IMSG_SOCKET_PACKET:
+			if ((imsg.hdr.len - IMSG_HEADER_SIZE) != sizeof(af)) {
+				log_warnx("%s: invalid socket request",
+				    __FUNCTION__);
+				break;
+			}
+
+			memcpy(&af, imsg.data, sizeof(af));
+			log_debug("%s: new packet socket (family %d)",
+			    __FUNCTION__, af);
+			sraw = icmp_packet_socket(af, pc->pc_instance);
+			compose_to_child(pc, IMSG_SOCKET_PACKET, sraw, &af,
+			    sizeof(af));
 			break;
-
 		default:
 			log_debug("unhandled message type: %#08x",
 			    imsg.hdr.type);
 			break;
 		}
+
+		imsg_free(&imsg);
 	}
 }
 
+/*
+ * Drain the results a worker published on its ring, they are read in
+ * place and given back all at once.
+ */
+static void
+main_ring_handler(evutil_socket_t sd, short ev, void *arg)
+{
+	struct proc_ctx *pc = arg;
+	struct icmp_record *ir;
+	struct icmp_host *ih;
+
+	pc->pc_ringwakeups++;
+	shmring_doorbell_clear(&pc->pc_ring);
+	do {
+		while ((ir = shmring_next(&pc->pc_ring)) != NULL) {
+			pc->pc_ringrecords++;
+			switch (ir->ir_type) {
+			case IR_EVENT:
+				ih = find_ih(ir->ir_event.ihe_index);
+				if (ih == NULL)
+					break;
+
+				log_icmp_host_event(ih, &ir->ir_event);
+				break;
+			case IR_RTT:
+				if (find_ih(ir->ir_rtt.ihr_index) == NULL)
+					break;
+
+				rtt_update(&main_rtt, ir->ir_rtt.ihr_rtt);
+				break;
+
+			default:
+				log_debug("unhandled record type: %u",
+				    ir->ir_type);
+				break;
+			}
+		}
+	} while (shmring_release(&pc->pc_ring));
+}
+
 /* Generic message sender dispatcher. */
 static void
 send_dispatcher(evutil_socket_t sd, short ev, void *arg)
@@ -167,6 +303,24 @@ compose_to_father(struct proc_ctx *pc, uint32_t type, const void *data,
 	return (0);
 }
 
+/* Send a message to the worker probing the host `index`. */
+int
+compose_to_worker(uint32_t index, uint32_t type, const void *data,
+    uint16_t datalen)
+{
+	uint32_t first, count;
+	int n;
+
+	for (n = 0; n < pcs_count; n++) {
+		icmp_shard(n, &first, &count);
+		if (index >= first && (index - first) < count)
+			return (compose_to_child(&pcs[n], type, -1, data,
+			    datalen));
+	}
+
+	return (-1);
+}
+
 /* Initialize the pipe with a handler. */
 void
 pc_add(struct event_base *eb, struct proc_ctx *pc, int fd, event_callback_fn func)
@@ -190,6 +344,7 @@ launch_proc(struct proc_ctx *pc)
 {
 	struct passwd *pw;
 	pid_t pid;
+	int n;
 
 #ifdef MACOSX_SUPPORT
 	if (socketpair(PF_LOCAL, SOCK_STREAM, AF_UNSPEC, pc->pc_sp) == -1 ||
@@ -203,6 +358,11 @@ launch_proc(struct proc_ctx *pc)
 #endif /* MACOSX_SUPPORT */
 		fatal("%s: socketpair", pc->pc_name);
 
+	/* Results ring, shared with the child. */
+	if (shmring_init(&pc->pc_ring, PC_RING_RECORDS,
+	    sizeof(struct icmp_record)) == -1)
+		fatalx("%s: failed to create the results ring", pc->pc_name);
+
 	switch ((pid = fork())) {
 	case 0:
 		break;
@@ -212,11 +372,26 @@ launch_proc(struct proc_ctx *pc)
 	default:
 		close(pc->pc_sp[1]);
 		pc->pc_sp[1] = -1;
+		shmring_consumer(&pc->pc_ring);
 		return (pc->pc_pid = pid);
 	}
 
 	close(pc->pc_sp[0]);
 	pc->pc_sp[0] = -1;
+	shmring_producer(&pc->pc_ring);
+
+	/*
+	 * Don't keep the pipes and the results rings of the siblings
+	 * spawned before us, we must not be able to write to them.
+	 */
+	for (n = 0; n < pcs_count; n++) {
+		if (pcs[n].pc_sp[0] == -1)
+			continue;
+
+		close(pcs[n].pc_sp[0]);
+		pcs[n].pc_sp[0] = -1;
+		shmring_close(&pcs[n].pc_ring);
+	}
 
 	/* Load user details to drop privileges. */
 	if ((pw = getpwnam(sc.sc_user)) == NULL)
@@ -260,7 +435,18 @@ db_initialize(void)
 	CREATE TABLE IF NOT EXISTS icmp_host_events (			\
 		id INTEGER PRIMARY KEY AUTOINCREMENT,			\
 		icmp_host_id INTEGER,					\
-		event INTEGER);"
+		event INTEGER,						\
+		time INTEGER,						\
+		rtt_min INTEGER,					\
+		rtt_avg INTEGER,					\
+		rtt_max INTEGER,					\
+		rtt_stddev INTEGER,					\
+		loss_permille INTEGER,					\
+		lost INTEGER,						\
+		late INTEGER,						\
+		duplicated INTEGER,					\
+		reordered INTEGER,					\
+		jitter INTEGER);"
 	);
 
 	TAILQ_FOREACH(ih, &sc.sc_ihlist, ih_entry)
@@ -282,9 +468,12 @@ main(int argc, char *argv[])
 	char *cfgfile = "/tmp/serverstatd.conf";
 	int foreground = 0;
 	int verbose = 0;
-	int c;
+	int c, n;
+	char *name;
+	struct proc_ctx *pc;
 	struct event_base *eb;
 	struct event *evsig_hup, *evsig_term, *evsig_int, *evsig_chld;
+	struct event *evsig_usr1;
 
 	while ((c = getopt(argc, argv, "df:v")) != -1) {
 		switch (c) {
@@ -330,8 +519,33 @@ main(int argc, char *argv[])
 			fatal("daemonize");
 #endif /* MACOSX_SUPPORT */
 
+#ifdef XDP_SUPPORT
+	/* The worker inherits the XDP socket and its rings. */
+	if (sc.sc_icmp_io == ICMP_IO_XDP && icmp_xdp_open() == -1)
+		fatalx("failed to set up XDP on %s", sc.sc_xdp_ifname);
+#endif /* XDP_SUPPORT */
+
+	/* Base of the filter estimate, before any probe goes out. */
+	main_inmsgsok = (icmp_snmp_inmsgs(&main_inmsgs) == 0);
+
 	/* Launch children processes. */
-	launch_proc(&pcs[0]);
+	pcs_count = sc.sc_icmp_workers;
+	if ((pcs = calloc(pcs_count, sizeof(*pcs))) == NULL)
+		fatal("calloc");
+	for (n = 0; n < pcs_count; n++) {
+		pc = &pcs[n];
+		if (pcs_count == 1)
+			pc->pc_name = "icmp probe";
+		else if (asprintf(&name, "icmp probe %d", n) == -1)
+			fatal("asprintf");
+		else
+			pc->pc_name = name;
+		pc->pc_func = icmp_handler;
+		pc->pc_instance = n;
+		pc->pc_sp[0] = pc->pc_sp[1] = -1;
+	}
+	for (n = 0; n < pcs_count; n++)
+		launch_proc(&pcs[n]);
 
 	/* Register all events then go to main loop. */
 	eb = event_base_new();
@@ -341,14 +555,30 @@ main(int argc, char *argv[])
 	evsig_term = evsignal_new(eb, SIGTERM, main_term_handler, NULL);
 	evsig_int = evsignal_new(eb, SIGINT, main_term_handler, NULL);
 	evsig_hup = evsignal_new(eb, SIGHUP, main_hup_handler, NULL);
+	evsig_usr1 = evsignal_new(eb, SIGUSR1, main_usr1_handler, NULL);
 	evsignal_add(evsig_chld, NULL);
 	evsignal_add(evsig_term, NULL);
 	evsignal_add(evsig_int, NULL);
 	evsignal_add(evsig_hup, NULL);
+	evsignal_add(evsig_usr1, NULL);
 
-	pc_add(eb, &pcs[0], pcs[0].pc_sp[0], main_dispatcher);
+	for (n = 0; n < pcs_count; n++) {
+		pc_add(eb, &pcs[n], pcs[n].pc_sp[0], main_dispatcher);
+
+		pcs[n].pc_ringev = event_new(eb, pcs[n].pc_ring.sr_rfd,
+		    EV_READ | EV_PERSIST, main_ring_handler, &pcs[n]);
+		if (pcs[n].pc_ringev == NULL ||
+		    event_add(pcs[n].pc_ringev, NULL) == -1)
+			fatalx("%s: failed to watch the results ring",
+			    pcs[n].pc_name);
+	}
 
 	db_initialize();
+	dns_init(eb);
+
+	/* Workers report host events by index. */
+	if (ih_table_init(0, sc.sc_ihcount) == -1)
+		fatalx("failed to index the hosts");
 
 	log_info("started");
 
@@ -31,6 +31,8 @@
 
 #include <sqlite3.h>
 
+#include "shmring.h"
+#include "timewheel.h"
 #include "icmp_host.h"
 
 #ifndef MIN
@@ -38,6 +40,11 @@
 	(((x) > (y)) ? (y) : (x))
 #endif /* MIN */
 
+#ifndef MAX
+#define MAX(x, y) \
+	(((x) > (y)) ? (x) : (y))
+#endif /* MAX */
+
 #define NOF(total, ssize) \
 	((total) / (ssize))
 
@@ -47,6 +54,7 @@ typedef void (*handler_func)(struct proc_ctx *);
 struct proc_ctx {
 	const char *pc_name;
 	handler_func pc_func;
+	int pc_instance; /* worker index */
 	pid_t pc_pid;
 	int pc_sp[2];
 	struct imsgbuf pc_ibuf;
@@ -54,18 +62,66 @@ struct proc_ctx {
 	struct event *pc_evout;
 	struct event_base *pc_eb;
 	void *pc_data;
+
+	/* Worker results, published by the child and drained by the parent. */
+	struct shmring pc_ring;
+	struct event *pc_ringev;
+	uint64_t pc_ringrecords;
+	uint64_t pc_ringwakeups;
 };
 
+/* Records of the worker result rings. */
+#define PC_RING_RECORDS (16384)
+
 enum proc_msg_type {
 	IMSG_SOCKET_RAW,
-	IMSG_HOST_UP,
-	IMSG_HOST_DOWN,
+	IMSG_ICMP_STATS,
+	IMSG_HOST_ADDRESS,
+	IMSG_SOCKET_PACKET,
 };
 
+enum icmp_socket_type {
+	ICMP_SOCKET_RAW = 0,
+	ICMP_SOCKET_DGRAM, /* unprivileged ping sockets */
+};
+
+enum icmp_io_type {
+	ICMP_IO_EVENT = 0,
+	ICMP_IO_URING, /* needs IO_URING_SUPPORT */
+	ICMP_IO_PACKET, /* Linux PACKET_MMAP receive ring */
+	ICMP_IO_XDP, /* needs XDP_SUPPORT */
+};
+
+#define ICMP_MAX_WORKERS (64)
+#define DNS_MAX_NAMESERVERS (8)
+
 struct serverstatd_conf {
 	char *sc_user;
 	char *sc_chroot;
-	TAILQ_HEAD(, icmp_host) sc_ihlist;
+	enum icmp_socket_type sc_icmp_socket;
+	/* Echo id of the first worker, the next ones count up from it. */
+	uint16_t sc_icmp_idbase;
+	/* Number of probes, indexed in configuration order. */
+	uint32_t sc_ihcount;
+	/* Key of the echo payload cookies, generated at startup. */
+	uint8_t sc_icmp_key[16];
+	/* Probe timing defaults of the following icmp-probe blocks. */
+	struct icmp_timing sc_timing;
+	/* Keep no per-packet state, replies carry everything. */
+	int sc_icmp_stateless;
+	/* Probes per second budget shared by the workers, zero is unlimited. */
+	uint32_t sc_icmp_pps;
+	/* Probe socket I/O backend. */
+	enum icmp_io_type sc_icmp_io;
+	/* Interface and queue of the XDP echo reply receive path. */
+	char *sc_xdp_ifname;
+	unsigned sc_xdp_queue;
+	/* ICMP probe processes, each probing its share of the hosts. */
+	int sc_icmp_workers;
+	/* Resolvers for probe names, /etc/resolv.conf is used if none. */
+	char *sc_nameservers[DNS_MAX_NAMESERVERS];
+	int sc_nameservercount;
+	TAILQ_HEAD(ih_list, icmp_host) sc_ihlist;
 };
 
 extern struct serverstatd_conf sc;
@@ -74,6 +130,7 @@ extern struct serverstatd_conf sc;
 void pc_add(struct event_base *, struct proc_ctx *, int, event_callback_fn);
 int compose_to_child(struct proc_ctx *, uint32_t, int, const void *, uint16_t);
 int compose_to_father(struct proc_ctx *, uint32_t, const void *, uint16_t);
+int compose_to_worker(uint32_t, uint32_t, const void *, uint16_t);
 
 /* db.c */
 int db_init(const char *);
@@ -87,12 +144,27 @@ void db_finalize(struct sqlite3_stmt **);
 int db_execute_len(const char *, size_t);
 int db_execute(const char *);
 
+/* dns.c */
+void dns_init(struct event_base *);
+
 /* parse.y */
 int parse_config(const char *, struct serverstatd_conf *);
 
 /* icmp.c */
-int icmp_socket(void);
+int icmp_socket(int, int);
+int icmp_packet_socket(int, int);
+int icmp_xdp_open(void);
+void icmp_shard(int, uint32_t *, uint32_t *);
 void icmp_handler(struct proc_ctx *);
+int icmp_snmp_inmsgs(uint64_t *);
+
+/* cksum.c */
+int in_cksum(const uint16_t *, int);
+int in_cksum_scalar(const uint16_t *, int);
+uint16_t in_cksum_update(uint16_t, uint16_t, uint16_t);
+
+/* siphash.c */
+uint64_t siphash24(const uint8_t *, const void *, size_t);
 
 /* log.c */
 void log_init(int);
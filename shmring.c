@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2016 Rafael Zalamena <rzalamena@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/mman.h>
+#ifdef LINUX_SUPPORT
+#include <sys/eventfd.h>
+#endif /* LINUX_SUPPORT */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "serverstatd.h"
+#include "shmring.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif /* MAP_ANONYMOUS */
+
+#define SHMRING_LOAD(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define SHMRING_STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+/*
+ * Each side publishes its index and then reads the other one, the full
+ * barrier in between makes sure at least one of them sees the update:
+ * either the consumer finds the new records or the producer rings.
+ */
+#define SHMRING_FENCE()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+static int
+shmring_doorbell_init(struct shmring *sr)
+{
+#ifdef LINUX_SUPPORT
+	sr->sr_rfd = sr->sr_wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (sr->sr_rfd == -1) {
+		log_warn("%s: eventfd", __FUNCTION__);
+		return (-1);
+	}
+#else
+	int fds[2];
+
+	if (pipe(fds) == -1) {
+		log_warn("%s: pipe", __FUNCTION__);
+		return (-1);
+	}
+	sr->sr_rfd = fds[0];
+	sr->sr_wfd = fds[1];
+	if (evutil_make_socket_nonblocking(sr->sr_rfd) == -1 ||
+	    evutil_make_socket_nonblocking(sr->sr_wfd) == -1 ||
+	    evutil_make_socket_closeonexec(sr->sr_rfd) == -1 ||
+	    evutil_make_socket_closeonexec(sr->sr_wfd) == -1) {
+		close(sr->sr_rfd);
+		close(sr->sr_wfd);
+		return (-1);
+	}
+#endif /* LINUX_SUPPORT */
+
+	return (0);
+}
+
+/* Map a ring of `count` records of `recsize` bytes, before forking. */
+int
+shmring_init(struct shmring *sr, uint32_t count, size_t recsize)
+{
+	char *p;
+
+	memset(sr, 0, sizeof(*sr));
+	if (count == 0 || (count & (count - 1)) != 0) {
+		log_warnx("%s: ring size must be a power of two", __FUNCTION__);
+		return (-1);
+	}
+
+	sr->sr_count = count;
+	sr->sr_recsize = recsize;
+	sr->sr_maplen = sizeof(*sr->sr_hdr) + (size_t) count * recsize;
+	p = mmap(NULL, sr->sr_maplen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		log_warn("%s: mmap", __FUNCTION__);
+		return (-1);
+	}
+	sr->sr_hdr = (struct shmring_hdr *) p;
+	sr->sr_recs = p + sizeof(*sr->sr_hdr);
+
+	if (shmring_doorbell_init(sr) == -1) {
+		munmap(p, sr->sr_maplen);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/* Keep only the producer side of the doorbell. */
+void
+shmring_producer(struct shmring *sr)
+{
+	if (sr->sr_rfd != sr->sr_wfd)
+		close(sr->sr_rfd);
+	sr->sr_rfd = -1;
+}
+
+/* Keep only the consumer side of the doorbell. */
+void
+shmring_consumer(struct shmring *sr)
+{
+	if (sr->sr_rfd != sr->sr_wfd)
+		close(sr->sr_wfd);
+	sr->sr_wfd = -1;
+}
+
+/* Let go of a ring of another process: unmap it, close the doorbell. */
+void
+shmring_close(struct shmring *sr)
+{
+	if (sr->sr_hdr != NULL)
+		munmap(sr->sr_hdr, sr->sr_maplen);
+	if (sr->sr_wfd != -1 && sr->sr_wfd != sr->sr_rfd)
+		close(sr->sr_wfd);
+	if (sr->sr_rfd != -1)
+		close(sr->sr_rfd);
+
+	memset(sr, 0, sizeof(*sr));
+	sr->sr_rfd = sr->sr_wfd = -1;
+}
+
+/*
+ * Producer: get the next free record leaving at least `keep` records
+ * free, NULL if there is no room. It is only visible to the consumer
+ * after shmring_publish().
+ */
+void *
+shmring_reserve(struct shmring *sr, uint32_t keep)
+{
+	char *rec;
+
+	if ((sr->sr_local - sr->sr_peer) + keep >= sr->sr_count) {
+		sr->sr_peer = SHMRING_LOAD(&sr->sr_hdr->sh_head);
+		if ((sr->sr_local - sr->sr_peer) + keep >= sr->sr_count)
+			return (NULL);
+	}
+
+	rec = sr->sr_recs + (size_t) (sr->sr_local & (sr->sr_count - 1)) *
+	    sr->sr_recsize;
+	sr->sr_local++;
+	return (rec);
+}
+
+/* Producer: account a record that didn't fit. */
+void
+shmring_drop(struct shmring *sr)
+{
+	__atomic_fetch_add(&sr->sr_hdr->sh_dropped, 1, __ATOMIC_RELAXED);
+}
+
+/* Producer: make the reserved records visible, waking the consumer up. */
+void
+shmring_publish(struct shmring *sr)
+{
+	struct shmring_hdr *sh = sr->sr_hdr;
+	uint64_t one = 1;
+	uint32_t tail = sh->sh_tail;
+
+	if (sr->sr_local == tail)
+		return;
+
+	SHMRING_STORE(&sh->sh_tail, sr->sr_local);
+	SHMRING_FENCE();
+	if (SHMRING_LOAD(&sh->sh_head) != tail)
+		return;
+
+	/* A full pipe already means a pending wakeup. */
+#ifdef LINUX_SUPPORT
+	if (write(sr->sr_wfd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+#else
+	if (write(sr->sr_wfd, &one, 1) == -1 && errno != EAGAIN)
+#endif /* LINUX_SUPPORT */
+		log_warn("%s: write", __FUNCTION__);
+}
+
+/* Consumer: next published record or NULL, read in place. */
+void *
+shmring_next(struct shmring *sr)
+{
+	char *rec;
+
+	if (sr->sr_local == sr->sr_peer) {
+		sr->sr_peer = SHMRING_LOAD(&sr->sr_hdr->sh_tail);
+		if (sr->sr_local == sr->sr_peer)
+			return (NULL);
+	}
+
+	rec = sr->sr_recs + (size_t) (sr->sr_local & (sr->sr_count - 1)) *
+	    sr->sr_recsize;
+	sr->sr_local++;
+	return (rec);
+}
+
+/*
+ * Consumer: give the records read back to the producer. Returns 1 if
+ * more records were published meanwhile, they won't ring the doorbell.
+ */
+int
+shmring_release(struct shmring *sr)
+{
+	SHMRING_STORE(&sr->sr_hdr->sh_head, sr->sr_local);
+	SHMRING_FENCE();
+	sr->sr_peer = SHMRING_LOAD(&sr->sr_hdr->sh_tail);
+	return (sr->sr_peer != sr->sr_local);
+}
+
+/* Consumer: acknowledge the doorbell before reading the ring. */
+void
+shmring_doorbell_clear(struct shmring *sr)
+{
+#ifdef LINUX_SUPPORT
+	uint64_t count;
+
+	if (read(sr->sr_rfd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+		log_warn("%s: read", __FUNCTION__);
+#else
+	char buf[64];
+
+	while (read(sr->sr_rfd, buf, sizeof(buf)) > 0)
+		/* NOTHING */;
+#endif /* LINUX_SUPPORT */
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2016 Rafael Zalamena <rzalamena@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _SHMRING_H_
+#define _SHMRING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Shared memory ring header, the producer and consumer indexes live on
+ * cache lines of their own.
+ */
+struct shmring_hdr {
+	uint32_t sh_tail __attribute__((aligned(64))); /* producer */
+	uint64_t sh_dropped; /* records the producer found no room for */
+	uint32_t sh_head __attribute__((aligned(64))); /* consumer */
+};
+
+/*
+ * Single producer, single consumer ring of fixed size records, mapped
+ * before fork() so both processes share it. Records are written and read
+ * in place. The producer rings the doorbell only when the consumer had
+ * caught up, so a busy consumer is not woken up for every batch.
+ */
+struct shmring {
+	struct shmring_hdr *sr_hdr;
+	char *sr_recs;
+	size_t sr_recsize;
+	size_t sr_maplen;
+	uint32_t sr_count; /* records, a power of two */
+	uint32_t sr_local; /* our index, not yet published */
+	uint32_t sr_peer; /* last seen index of the other side */
+
+	/* Doorbell, a single eventfd or the two ends of a pipe. */
+	int sr_rfd;
+	int sr_wfd;
+};
+
+/* shmring.c */
+int shmring_init(struct shmring *, uint32_t, size_t);
+void shmring_producer(struct shmring *);
+void shmring_consumer(struct shmring *);
+void shmring_close(struct shmring *);
+
+void *shmring_reserve(struct shmring *, uint32_t);
+void shmring_publish(struct shmring *);
+void shmring_drop(struct shmring *);
+
+void *shmring_next(struct shmring *);
+int shmring_release(struct shmring *);
+void shmring_doorbell_clear(struct shmring *);
+
+#endif /* _SHMRING_H_ */
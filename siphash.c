@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2016 Rafael Zalamena <rzalamena@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+
+#include "serverstatd.h"
+
+/*
+ * SipHash-2-4 (Aumasson and Bernstein), a keyed hash fast enough for
+ * short inputs. It is used to authenticate what we put in the echo
+ * payload, so replies we didn't ask for are cheap to reject.
+ */
+
+#define SIP_ROTL(x, b) (uint64_t) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIP_ROUND(v0, v1, v2, v3) do {					\
+	v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32);	\
+	v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2;			\
+	v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0;			\
+	v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32);	\
+} while (0)
+
+/* Load a little endian 64 bit word. */
+static inline uint64_t
+sip_load64(const uint8_t *p)
+{
+	return ((uint64_t) p[0] | (uint64_t) p[1] << 8 |
+	    (uint64_t) p[2] << 16 | (uint64_t) p[3] << 24 |
+	    (uint64_t) p[4] << 32 | (uint64_t) p[5] << 40 |
+	    (uint64_t) p[6] << 48 | (uint64_t) p[7] << 56);
+}
+
+uint64_t
+siphash24(const uint8_t *key, const void *src, size_t len)
+{
+	const uint8_t *p = src;
+	uint64_t k0, k1, v0, v1, v2, v3, m, b;
+	size_t left;
+
+	k0 = sip_load64(key);
+	k1 = sip_load64(key + 8);
+	v0 = k0 ^ 0x736f6d6570736575ULL;
+	v1 = k1 ^ 0x646f72616e646f6dULL;
+	v2 = k0 ^ 0x6c7967656e657261ULL;
+	v3 = k1 ^ 0x7465646279746573ULL;
+
+	b = (uint64_t) len << 56;
+	for (left = len; left >= 8; left -= 8, p += 8) {
+		m = sip_load64(p);
+		v3 ^= m;
+		SIP_ROUND(v0, v1, v2, v3);
+		SIP_ROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+
+	switch (left) {
+	case 7:
+		b |= (uint64_t) p[6] << 48;
+		/* FALLTHROUGH */
+	case 6:
+		b |= (uint64_t) p[5] << 40;
+		/* FALLTHROUGH */
+	case 5:
+		b |= (uint64_t) p[4] << 32;
+		/* FALLTHROUGH */
+	case 4:
+		b |= (uint64_t) p[3] << 24;
+		/* FALLTHROUGH */
+	case 3:
+		b |= (uint64_t) p[2] << 16;
+		/* FALLTHROUGH */
+	case 2:
+		b |= (uint64_t) p[1] << 8;
+		/* FALLTHROUGH */
+	case 1:
+		b |= (uint64_t) p[0];
+		break;
+	}
+
+	v3 ^= b;
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+	v0 ^= b;
+
+	v2 ^= 0xff;
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+
+	return (v0 ^ v1 ^ v2 ^ v3);
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2016 Rafael Zalamena <rzalamena@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+
+#include "serverstatd.h"
+
+/* Current tick, rounded down. */
+static inline uint64_t
+tw_now(struct timewheel *tw)
+{
+	return ((mono_ns() - tw->tw_start) / TW_TICK_NS);
+}
+
+/* Initialize an empty timer wheel starting now. */
+void
+tw_init(struct timewheel *tw)
+{
+	int i;
+
+	for (i = 0; i < TW_SLOTS; i++)
+		LIST_INIT(&tw->tw_slots[i]);
+
+	tw->tw_start = mono_ns();
+	tw->tw_tick = 0;
+}
+
+/* Initialize timer entry. */
+void
+tw_entry_init(struct tw_entry *twe, void *arg)
+{
+	twe->twe_pending = 0;
+	twe->twe_expire = 0;
+	twe->twe_arg = arg;
+}
+
+/* (Re)schedule entry to expire in `ms` milliseconds. */
+void
+tw_add(struct timewheel *tw, struct tw_entry *twe, unsigned int ms)
+{
+	uint64_t expire;
+
+	tw_del(twe);
+
+	/* Round up, but never schedule for a tick already processed. */
+	expire = (mono_ns() - tw->tw_start + (uint64_t) ms * 1000000ULL +
+	    TW_TICK_NS - 1) / TW_TICK_NS;
+	if (expire <= tw->tw_tick)
+		expire = tw->tw_tick + 1;
+
+	twe->twe_expire = expire;
+	twe->twe_pending = 1;
+	LIST_INSERT_HEAD(&tw->tw_slots[expire & (TW_SLOTS - 1)], twe,
+	    twe_entry);
+}
+
+/* Remove entry from the wheel if scheduled. */
+void
+tw_del(struct tw_entry *twe)
+{
+	if (twe->twe_pending == 0)
+		return;
+
+	LIST_REMOVE(twe, twe_entry);
+	twe->twe_pending = 0;
+}
+
+/*
+ * Move every entry that expired since the last call to `expired`.
+ *
+ * If we fell behind more than a revolution every slot is visited only
+ * once, entries are compared against the current tick anyway.
+ */
+void
+tw_expire(struct timewheel *tw, struct tw_list *expired)
+{
+	struct tw_list *slot;
+	struct tw_entry *twe, *twen;
+	uint64_t now, tick, last;
+
+	now = tw_now(tw);
+	if (now <= tw->tw_tick)
+		return;
+
+	last = now;
+	if ((now - tw->tw_tick) > TW_SLOTS)
+		last = tw->tw_tick + TW_SLOTS;
+
+	for (tick = tw->tw_tick + 1; tick <= last; tick++) {
+		slot = &tw->tw_slots[tick & (TW_SLOTS - 1)];
+		LIST_FOREACH_SAFE(twe, slot, twe_entry, twen) {
+			if (twe->twe_expire > now)
+				continue;
+
+			LIST_REMOVE(twe, twe_entry);
+			twe->twe_pending = 0;
+			LIST_INSERT_HEAD(expired, twe, twe_entry);
+		}
+	}
+
+	tw->tw_tick = now;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2016 Rafael Zalamena <rzalamena@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _TIMEWHEEL_H_
+#define _TIMEWHEEL_H_
+
+#include <sys/queue.h>
+
+#include <stdint.h>
+#include <time.h>
+
+/* Monotonic clock in nanoseconds. */
+static inline uint64_t
+mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/* Wall clock in nanoseconds, the clock kernel packet timestamps use. */
+static inline uint64_t
+real_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*
+ * Hashed timer wheel:
+ *
+ * Entries are hashed by expiration tick into TW_SLOTS buckets, timeouts
+ * longer than a wheel revolution just stay in their bucket until their
+ * tick comes. Adding and removing entries is O(1).
+ */
+#define TW_TICK_MS (10)
+#define TW_TICK_NS ((uint64_t) TW_TICK_MS * 1000000ULL)
+/* Must be a power of two. */
+#define TW_SLOTS (4096)
+
+struct tw_entry {
+	LIST_ENTRY(tw_entry) twe_entry;
+	uint64_t twe_expire; /* expiration tick */
+	int twe_pending;
+	void *twe_arg;
+};
+
+LIST_HEAD(tw_list, tw_entry);
+
+struct timewheel {
+	struct tw_list tw_slots[TW_SLOTS];
+	uint64_t tw_start; /* monotonic time of tick zero */
+	uint64_t tw_tick; /* last processed tick */
+};
+
+/* timewheel.c */
+void tw_init(struct timewheel *);
+void tw_entry_init(struct tw_entry *, void *);
+void tw_add(struct timewheel *, struct tw_entry *, unsigned int);
+void tw_del(struct tw_entry *);
+void tw_expire(struct timewheel *, struct tw_list *);
+
+#endif /* _TIMEWHEEL_H_ */
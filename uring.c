@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2016 Rafael Zalamena <rzalamena@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "serverstatd.h"
+#include "uring.h"
+
+/*
+ * The ring indexes are shared with the kernel: read the ones it writes
+ * with acquire and publish ours with release semantics.
+ */
+#define URING_LOAD(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define URING_STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int
+uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int
+uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+	return (syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL,
+	    0));
+}
+
+static int
+uring_register(int fd, unsigned opcode, void *arg, unsigned nargs)
+{
+	return (syscall(__NR_io_uring_register, fd, opcode, arg, nargs));
+}
+
+/*
+ * Create a ring with `entries` submission slots and `cqentries`
+ * completion slots (zero for the kernel default), and map its queues.
+ */
+int
+uring_init(struct uring *ur, unsigned entries, unsigned cqentries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(ur, 0, sizeof(*ur));
+	memset(&p, 0, sizeof(p));
+	if (cqentries) {
+		p.flags |= IORING_SETUP_CQSIZE;
+		p.cq_entries = cqentries;
+	}
+	if ((ur->ur_fd = uring_setup(entries, &p)) == -1) {
+		log_warn("%s: io_uring_setup", __FUNCTION__);
+		return (-1);
+	}
+
+	/* Multishot receives with provided buffers need both. */
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) == 0 ||
+	    (p.features & IORING_FEAT_NODROP) == 0) {
+		log_warnx("%s: kernel io_uring is too old", __FUNCTION__);
+		close(ur->ur_fd);
+		return (-1);
+	}
+
+	ur->ur_maplen = MAX(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+	    p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+	ur->ur_sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ur->ur_map = mmap(NULL, ur->ur_maplen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ur->ur_fd, IORING_OFF_SQ_RING);
+	if (ur->ur_map == MAP_FAILED) {
+		log_warn("%s: mmap", __FUNCTION__);
+		close(ur->ur_fd);
+		return (-1);
+	}
+
+	ur->ur_sqes = mmap(NULL, ur->ur_sqeslen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ur->ur_fd, IORING_OFF_SQES);
+	if (ur->ur_sqes == MAP_FAILED) {
+		log_warn("%s: mmap", __FUNCTION__);
+		munmap(ur->ur_map, ur->ur_maplen);
+		close(ur->ur_fd);
+		return (-1);
+	}
+
+	sq = cq = ur->ur_map;
+	ur->ur_sqentries = p.sq_entries;
+	ur->ur_sqhead = (unsigned *) (sq + p.sq_off.head);
+	ur->ur_sqtail = (unsigned *) (sq + p.sq_off.tail);
+	ur->ur_sqmask = (unsigned *) (sq + p.sq_off.ring_mask);
+	ur->ur_sqflags = (unsigned *) (sq + p.sq_off.flags);
+	ur->ur_sqarray = (unsigned *) (sq + p.sq_off.array);
+	ur->ur_sqlocal = *ur->ur_sqtail;
+
+	ur->ur_cqhead = (unsigned *) (cq + p.cq_off.head);
+	ur->ur_cqtail = (unsigned *) (cq + p.cq_off.tail);
+	ur->ur_cqmask = (unsigned *) (cq + p.cq_off.ring_mask);
+	ur->ur_cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	return (0);
+}
+
+void
+uring_close(struct uring *ur)
+{
+	munmap(ur->ur_sqes, ur->ur_sqeslen);
+	munmap(ur->ur_map, ur->ur_maplen);
+	close(ur->ur_fd);
+	ur->ur_fd = -1;
+}
+
+/* Get a cleared submission entry, NULL if the queue is full. */
+struct io_uring_sqe *
+uring_get_sqe(struct uring *ur)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	if ((ur->ur_sqlocal - URING_LOAD(ur->ur_sqhead)) >= ur->ur_sqentries)
+		return (NULL);
+
+	idx = ur->ur_sqlocal & *ur->ur_sqmask;
+	ur->ur_sqarray[idx] = idx;
+	ur->ur_sqlocal++;
+
+	sqe = &ur->ur_sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	return (sqe);
+}
+
+/*
+ * Submit the queued entries and wait for `wait` completions, all with
+ * a single system call. The completion queue overflow is also flushed
+ * here, returns -1 on failure.
+ */
+int
+uring_submit(struct uring *ur, unsigned wait)
+{
+	unsigned submit, flags = 0;
+	int n;
+
+	submit = ur->ur_sqlocal - *ur->ur_sqtail;
+	URING_STORE(ur->ur_sqtail, ur->ur_sqlocal);
+
+	if (wait || (URING_LOAD(ur->ur_sqflags) & IORING_SQ_CQ_OVERFLOW))
+		flags |= IORING_ENTER_GETEVENTS;
+	if (submit == 0 && flags == 0)
+		return (0);
+
+	do {
+		n = uring_enter(ur->ur_fd, submit, wait, flags);
+	} while (n == -1 && errno == EINTR);
+
+	return ((n == -1) ? -1 : 0);
+}
+
+/* Next completion or NULL, release it with uring_cqe_seen(). */
+struct io_uring_cqe *
+uring_peek_cqe(struct uring *ur)
+{
+	unsigned head = *ur->ur_cqhead;
+
+	if (head == URING_LOAD(ur->ur_cqtail))
+		return (NULL);
+
+	return (&ur->ur_cqes[head & *ur->ur_cqmask]);
+}
+
+void
+uring_cqe_seen(struct uring *ur)
+{
+	URING_STORE(ur->ur_cqhead, *ur->ur_cqhead + 1);
+}
+
+/*
+ * Register a provided buffer ring of `entries` buffers of `buflen` bytes
+ * with the group id `bgid`, and hand all of them to the kernel.
+ */
+int
+uring_bufring_init(struct uring *ur, struct uring_bufring *ub,
+    unsigned entries, size_t buflen, uint16_t bgid)
+{
+	struct io_uring_buf_reg reg;
+	unsigned i;
+
+	memset(ub, 0, sizeof(*ub));
+	ub->ub_entries = entries;
+	ub->ub_buflen = buflen;
+	ub->ub_bgid = bgid;
+	ub->ub_ringlen = entries * sizeof(struct io_uring_buf);
+
+	ub->ub_ring = mmap(NULL, ub->ub_ringlen, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ub->ub_ring == MAP_FAILED) {
+		log_warn("%s: mmap", __FUNCTION__);
+		return (-1);
+	}
+	if ((ub->ub_bufs = calloc(entries, buflen)) == NULL) {
+		log_warn("%s", __FUNCTION__);
+		munmap(ub->ub_ring, ub->ub_ringlen);
+		return (-1);
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t) ub->ub_ring;
+	reg.ring_entries = entries;
+	reg.bgid = bgid;
+	if (uring_register(ur->ur_fd, IORING_REGISTER_PBUF_RING, &reg,
+	    1) == -1) {
+		log_warn("%s: io_uring_register", __FUNCTION__);
+		free(ub->ub_bufs);
+		munmap(ub->ub_ring, ub->ub_ringlen);
+		return (-1);
+	}
+
+	for (i = 0; i < entries; i++)
+		uring_buf_recycle(ub, i);
+
+	return (0);
+}
+
+/* Give a buffer back to the kernel. */
+void
+uring_buf_recycle(struct uring_bufring *ub, uint16_t bid)
+{
+	struct io_uring_buf *buf;
+	uint16_t tail = ub->ub_ring->tail;
+
+	buf = &ub->ub_ring->bufs[tail & (ub->ub_entries - 1)];
+	buf->addr = (uintptr_t) uring_buf(ub, bid);
+	buf->len = ub->ub_buflen;
+	buf->bid = bid;
+
+	URING_STORE(&ub->ub_ring->tail, tail + 1);
+}
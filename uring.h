@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2016 Rafael Zalamena <rzalamena@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <linux/io_uring.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Minimal io_uring ring handling on top of the raw system calls, just
+ * what the probe I/O needs: a submission and a completion queue, and
+ * provided buffer rings for multishot receives.
+ */
+struct uring {
+	int ur_fd;
+	unsigned ur_sqentries;
+
+	/* Submission queue */
+	unsigned *ur_sqhead;
+	unsigned *ur_sqtail;
+	unsigned *ur_sqmask;
+	unsigned *ur_sqflags;
+	unsigned *ur_sqarray;
+	struct io_uring_sqe *ur_sqes;
+	unsigned ur_sqlocal; /* tail of the not yet submitted entries */
+
+	/* Completion queue */
+	unsigned *ur_cqhead;
+	unsigned *ur_cqtail;
+	unsigned *ur_cqmask;
+	struct io_uring_cqe *ur_cqes;
+
+	void *ur_map; /* both queues share a single mapping */
+	size_t ur_maplen;
+	size_t ur_sqeslen;
+};
+
+/* Provided buffer ring, buffers are `ub_buflen` bytes each. */
+struct uring_bufring {
+	struct io_uring_buf_ring *ub_ring;
+	size_t ub_ringlen;
+	char *ub_bufs;
+	size_t ub_buflen;
+	unsigned ub_entries;
+	uint16_t ub_bgid;
+};
+
+/* uring.c */
+int uring_init(struct uring *, unsigned, unsigned);
+void uring_close(struct uring *);
+struct io_uring_sqe *uring_get_sqe(struct uring *);
+int uring_submit(struct uring *, unsigned);
+struct io_uring_cqe *uring_peek_cqe(struct uring *);
+void uring_cqe_seen(struct uring *);
+
+int uring_bufring_init(struct uring *, struct uring_bufring *, unsigned,
+    size_t, uint16_t);
+void uring_buf_recycle(struct uring_bufring *, uint16_t);
+
+static inline void *
+uring_buf(struct uring_bufring *ub, uint16_t bid)
+{
+	return (ub->ub_bufs + (size_t) bid * ub->ub_buflen);
+}
+
+#endif /* _URING_H_ */
@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2016 Rafael Zalamena <rzalamena@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+
+#include <net/if.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "serverstatd.h"
+#include "xdp.h"
+
+/*
+ * AF_XDP echo reply receive path.
+ *
+ * A small XDP program checks every frame arriving on the interface and
+ * redirects the ICMP and ICMPv6 echo replies with an identifier in our
+ * range to the XDP socket of the queue it arrived on; everything else,
+ * including the replies of other ping programs, goes to the normal stack.
+ * The program is built here as raw instructions, so there is no compiler
+ * or library dependency.
+ */
+
+/* UMEM frames, all of them start in the fill ring. */
+#define XDP_FRAME_SIZE		(2048)
+#define XDP_FRAME_COUNT		(2048)
+#define XDP_RING_SIZE		XDP_FRAME_COUNT
+/* We never transmit, the completion ring is only required by bind(). */
+#define XDP_COMP_SIZE		(64)
+/* Queues the XSKMAP can redirect to. */
+#define XDP_MAX_QUEUES		(64)
+
+#define XDP_LOAD(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define XDP_STORE(p, v)		__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+#define XDP_INSN(c, d, s, o, i)						\
+	((struct bpf_insn) { .code = (c), .dst_reg = (d), .src_reg = (s),	\
+	    .off = (o), .imm = (i) })
+#define XDP_LDX(sz, d, s, o)	XDP_INSN(BPF_LDX | BPF_MEM | (sz), d, s, o, 0)
+#define XDP_MOVR(d, s)		XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define XDP_ALU(op, d, i)	XDP_INSN(BPF_ALU64 | (op) | BPF_K, d, 0, 0, i)
+#define XDP_JMPI(op, d, i, o)	XDP_INSN(BPF_JMP | (op) | BPF_K, d, 0, o, i)
+#define XDP_JMPR(op, d, s, o)	XDP_INSN(BPF_JMP | (op) | BPF_X, d, s, o, 0)
+
+static int
+xdp_bpf(int cmd, union bpf_attr *attr)
+{
+	return (syscall(__NR_bpf, cmd, attr, sizeof(*attr)));
+}
+
+/*
+ * Load the steering program. Replies have their identifier in
+ * [base, base + count), with wrap around.
+ */
+static int
+xdp_prog_load(int mapfd, uint16_t base, uint16_t count)
+{
+	/* Jump targets, the offsets below are relative to the next insn. */
+	enum { P_V6 = 17, P_ID = 25, P_PASS = 35 };
+	struct bpf_insn insns[] = {
+		/* 0: data and data_end */
+		XDP_MOVR(BPF_REG_6, BPF_REG_1),
+		XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_6, 0),
+		XDP_LDX(BPF_W, BPF_REG_3, BPF_REG_6, 4),
+		XDP_MOVR(BPF_REG_4, BPF_REG_2),
+		XDP_ALU(BPF_ADD, BPF_REG_4, 14 + 20 + 8),
+		/* 5 */
+		XDP_JMPR(BPF_JGT, BPF_REG_4, BPF_REG_3, P_PASS - 6),
+		XDP_LDX(BPF_H, BPF_REG_4, BPF_REG_2, 12),
+		XDP_JMPI(BPF_JEQ, BPF_REG_4, htons(ETH_P_IPV6), P_V6 - 8),
+		XDP_JMPI(BPF_JNE, BPF_REG_4, htons(ETH_P_IP), P_PASS - 9),
+		/* 9: IPv4 without options carrying an echo reply */
+		XDP_LDX(BPF_B, BPF_REG_4, BPF_REG_2, 14),
+		XDP_JMPI(BPF_JNE, BPF_REG_4, 0x45, P_PASS - 11),
+		XDP_LDX(BPF_B, BPF_REG_4, BPF_REG_2, 14 + 9),
+		XDP_JMPI(BPF_JNE, BPF_REG_4, IPPROTO_ICMP, P_PASS - 13),
+		XDP_LDX(BPF_B, BPF_REG_4, BPF_REG_2, 14 + 20),
+		/* 14 */
+		XDP_JMPI(BPF_JNE, BPF_REG_4, ICMP_ECHOREPLY, P_PASS - 15),
+		XDP_LDX(BPF_H, BPF_REG_4, BPF_REG_2, 14 + 20 + 4),
+		XDP_INSN(BPF_JMP | BPF_JA, 0, 0, P_ID - 17, 0),
+		/* 17: IPv6 without extension headers carrying an echo reply */
+		XDP_MOVR(BPF_REG_4, BPF_REG_2),
+		XDP_ALU(BPF_ADD, BPF_REG_4, 14 + 40 + 8),
+		XDP_JMPR(BPF_JGT, BPF_REG_4, BPF_REG_3, P_PASS - 20),
+		/* 20 */
+		XDP_LDX(BPF_B, BPF_REG_4, BPF_REG_2, 14 + 6),
+		XDP_JMPI(BPF_JNE, BPF_REG_4, IPPROTO_ICMPV6, P_PASS - 22),
+		XDP_LDX(BPF_B, BPF_REG_4, BPF_REG_2, 14 + 40),
+		XDP_JMPI(BPF_JNE, BPF_REG_4, ICMP6_ECHO_REPLY, P_PASS - 24),
+		XDP_LDX(BPF_H, BPF_REG_4, BPF_REG_2, 14 + 40 + 4),
+		/* 25: (ntohs(id) - base) & 0xffff < count */
+		XDP_INSN(BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_4, 0, 0, 16),
+		XDP_ALU(BPF_SUB, BPF_REG_4, base),
+		XDP_ALU(BPF_AND, BPF_REG_4, 0xffff),
+		XDP_JMPI(BPF_JGE, BPF_REG_4, count, P_PASS - 29),
+		/* 29: redirect to the socket of this queue */
+		XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_6,
+		    offsetof(struct xdp_md, rx_queue_index)),
+		XDP_INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD,
+		    0, mapfd),
+		XDP_INSN(0, 0, 0, 0, 0),
+		XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS),
+		XDP_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+		XDP_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+		/* 35 */
+		XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS),
+		XDP_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+	union bpf_attr attr;
+	char log[4096];
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.expected_attach_type = BPF_XDP;
+	attr.insns = (uintptr_t) insns;
+	attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+	attr.license = (uintptr_t) "Dual BSD/GPL";
+	attr.log_buf = (uintptr_t) log;
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+	log[0] = 0;
+	if ((fd = xdp_bpf(BPF_PROG_LOAD, &attr)) == -1)
+		log_warn("%s: bpf program rejected: %s", __FUNCTION__, log);
+
+	return (fd);
+}
+
+static int
+xdp_ring_map(int fd, struct xdp_ring *xr, struct xdp_ring_offset *off,
+    size_t entsize, off_t pgoff)
+{
+	char *p;
+
+	xr->xr_maplen = off->desc + XDP_RING_SIZE * entsize;
+	p = mmap(NULL, xr->xr_maplen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, pgoff);
+	if (p == MAP_FAILED) {
+		log_warn("%s: mmap", __FUNCTION__);
+		return (-1);
+	}
+
+	xr->xr_map = p;
+	xr->xr_producer = (uint32_t *) (p + off->producer);
+	xr->xr_consumer = (uint32_t *) (p + off->consumer);
+	xr->xr_desc = p + off->desc;
+	xr->xr_mask = XDP_RING_SIZE - 1;
+	return (0);
+}
+
+static int
+xdp_sock_open(struct xdp_sock *xs, int ifindex, unsigned queue)
+{
+	struct xdp_umem_reg ur;
+	struct xdp_mmap_offsets off;
+	struct sockaddr_xdp sxdp;
+	socklen_t optlen;
+	uint64_t *fill;
+	int size;
+	unsigned i;
+
+	if ((xs->xs_fd = socket(AF_XDP, SOCK_RAW, 0)) == -1) {
+		log_warn("%s: socket", __FUNCTION__);
+		return (-1);
+	}
+
+	/* Shared, so the kernel and a forked worker see the same pages. */
+	xs->xs_umemlen = (size_t) XDP_FRAME_COUNT * XDP_FRAME_SIZE;
+	xs->xs_umem = mmap(NULL, xs->xs_umemlen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (xs->xs_umem == MAP_FAILED) {
+		log_warn("%s: mmap", __FUNCTION__);
+		xs->xs_umem = NULL;
+		return (-1);
+	}
+
+	memset(&ur, 0, sizeof(ur));
+	ur.addr = (uintptr_t) xs->xs_umem;
+	ur.len = xs->xs_umemlen;
+	ur.chunk_size = XDP_FRAME_SIZE;
+	if (setsockopt(xs->xs_fd, SOL_XDP, XDP_UMEM_REG, &ur,
+	    sizeof(ur)) == -1) {
+		log_warn("%s: XDP_UMEM_REG", __FUNCTION__);
+		return (-1);
+	}
+
+	size = XDP_RING_SIZE;
+	if (setsockopt(xs->xs_fd, SOL_XDP, XDP_UMEM_FILL_RING, &size,
+	    sizeof(size)) == -1 ||
+	    setsockopt(xs->xs_fd, SOL_XDP, XDP_RX_RING, &size,
+	    sizeof(size)) == -1) {
+		log_warn("%s: ring setup", __FUNCTION__);
+		return (-1);
+	}
+	size = XDP_COMP_SIZE;
+	if (setsockopt(xs->xs_fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size,
+	    sizeof(size)) == -1) {
+		log_warn("%s: ring setup", __FUNCTION__);
+		return (-1);
+	}
+
+	optlen = sizeof(off);
+	if (getsockopt(xs->xs_fd, SOL_XDP, XDP_MMAP_OFFSETS, &off,
+	    &optlen) == -1) {
+		log_warn("%s: XDP_MMAP_OFFSETS", __FUNCTION__);
+		return (-1);
+	}
+	if (xdp_ring_map(xs->xs_fd, &xs->xs_rx, &off.rx,
+	    sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) == -1 ||
+	    xdp_ring_map(xs->xs_fd, &xs->xs_fill, &off.fr,
+	    sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) == -1)
+		return (-1);
+
+	/* Hand every frame to the kernel. */
+	fill = xs->xs_fill.xr_desc;
+	for (i = 0; i < XDP_FRAME_COUNT; i++)
+		fill[i] = (uint64_t) i * XDP_FRAME_SIZE;
+	xs->xs_fill.xr_local = XDP_FRAME_COUNT;
+	XDP_STORE(xs->xs_fill.xr_producer, xs->xs_fill.xr_local);
+	xs->xs_rx.xr_local = *xs->xs_rx.xr_consumer;
+
+	memset(&sxdp, 0, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = ifindex;
+	sxdp.sxdp_queue_id = queue;
+	if (bind(xs->xs_fd, (struct sockaddr *) &sxdp, sizeof(sxdp)) == -1) {
+		log_warn("%s: bind", __FUNCTION__);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Create the XDP socket of the interface queue and attach the program
+ * steering the echo replies with the identifiers [base, base + count)
+ * to it. The program stays attached while the socket lives.
+ */
+int
+xdp_open(struct xdp_sock *xs, const char *ifname, unsigned queue,
+    uint16_t base, uint16_t count)
+{
+	union bpf_attr attr;
+	int ifindex, mapfd = -1, progfd = -1, rv = -1;
+	uint32_t key = queue, value;
+
+	memset(xs, 0, sizeof(*xs));
+	xs->xs_fd = xs->xs_link = -1;
+
+	if ((ifindex = if_nametoindex(ifname)) == 0) {
+		log_warn("%s: %s", __FUNCTION__, ifname);
+		return (-1);
+	}
+	if (queue >= XDP_MAX_QUEUES) {
+		log_warnx("%s: queue %u out of range", __FUNCTION__, queue);
+		return (-1);
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(key);
+	attr.value_size = sizeof(value);
+	attr.max_entries = XDP_MAX_QUEUES;
+	if ((mapfd = xdp_bpf(BPF_MAP_CREATE, &attr)) == -1) {
+		log_warn("%s: bpf map", __FUNCTION__);
+		goto out;
+	}
+	if ((progfd = xdp_prog_load(mapfd, base, count)) == -1)
+		goto out;
+	if (xdp_sock_open(xs, ifindex, queue) == -1)
+		goto out;
+
+	value = xs->xs_fd;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = mapfd;
+	attr.key = (uintptr_t) &key;
+	attr.value = (uintptr_t) &value;
+	if (xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1) {
+		log_warn("%s: bpf map update", __FUNCTION__);
+		goto out;
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = progfd;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	if ((xs->xs_link = xdp_bpf(BPF_LINK_CREATE, &attr)) == -1) {
+		log_warn("%s: attach to %s", __FUNCTION__, ifname);
+		goto out;
+	}
+
+	rv = 0;
+
+ out:
+	/* The link holds the program and the program holds the map. */
+	if (progfd != -1)
+		close(progfd);
+	if (mapfd != -1)
+		close(mapfd);
+	if (rv == 0)
+		return (0);
+
+	if (xs->xs_rx.xr_map != NULL)
+		munmap(xs->xs_rx.xr_map, xs->xs_rx.xr_maplen);
+	if (xs->xs_fill.xr_map != NULL)
+		munmap(xs->xs_fill.xr_map, xs->xs_fill.xr_maplen);
+	if (xs->xs_umem != NULL)
+		munmap(xs->xs_umem, xs->xs_umemlen);
+	if (xs->xs_fd != -1)
+		close(xs->xs_fd);
+	memset(xs, 0, sizeof(*xs));
+	xs->xs_fd = xs->xs_link = -1;
+	return (rv);
+}
+
+/*
+ * Next received frame or NULL, its UMEM address must be given back with
+ * xdp_refill() and both are published to the kernel by xdp_sync().
+ */
+char *
+xdp_recv(struct xdp_sock *xs, uint32_t *len, uint64_t *addr)
+{
+	struct xdp_ring *xr = &xs->xs_rx;
+	struct xdp_desc *xd;
+
+	if (xr->xr_local == XDP_LOAD(xr->xr_producer))
+		return (NULL);
+
+	xd = (struct xdp_desc *) xr->xr_desc + (xr->xr_local & xr->xr_mask);
+	xr->xr_local++;
+	*len = xd->len;
+	*addr = xd->addr;
+	return (xs->xs_umem + xd->addr);
+}
+
+void
+xdp_refill(struct xdp_sock *xs, uint64_t addr)
+{
+	struct xdp_ring *xr = &xs->xs_fill;
+
+	((uint64_t *) xr->xr_desc)[xr->xr_local & xr->xr_mask] = addr;
+	xr->xr_local++;
+}
+
+void
+xdp_sync(struct xdp_sock *xs)
+{
+	XDP_STORE(xs->xs_rx.xr_consumer, xs->xs_rx.xr_local);
+	XDP_STORE(xs->xs_fill.xr_producer, xs->xs_fill.xr_local);
+}
+
+/* Frames dropped because the receive ring was full or out of frames. */
+int
+xdp_drops(struct xdp_sock *xs, uint64_t *drops)
+{
+	struct xdp_statistics xst;
+	socklen_t len = sizeof(xst);
+
+	if (getsockopt(xs->xs_fd, SOL_XDP, XDP_STATISTICS, &xst,
+	    &len) == -1) {
+		log_warn("%s: getsockopt(XDP_STATISTICS)", __FUNCTION__);
+		return (-1);
+	}
+
+	*drops = xst.rx_dropped + xst.rx_ring_full;
+	return (0);
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2016 Rafael Zalamena <rzalamena@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _XDP_H_
+#define _XDP_H_
+
+#include <linux/if_xdp.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Single producer, single consumer ring shared with the kernel. */
+struct xdp_ring {
+	uint32_t *xr_producer;
+	uint32_t *xr_consumer;
+	void *xr_desc;
+	uint32_t xr_mask;
+	uint32_t xr_local; /* our side, not yet published */
+	void *xr_map;
+	size_t xr_maplen;
+};
+
+/*
+ * AF_XDP socket receiving the frames our XDP program steers to it. The
+ * memory is all shared mappings, so a process forked after xdp_open()
+ * can use it as well.
+ */
+struct xdp_sock {
+	int xs_fd;
+	int xs_link; /* keeps the program attached */
+	char *xs_umem;
+	size_t xs_umemlen;
+	struct xdp_ring xs_rx;
+	struct xdp_ring xs_fill;
+};
+
+/* xdp.c */
+int xdp_open(struct xdp_sock *, const char *, unsigned, uint16_t,
+    uint16_t);
+char *xdp_recv(struct xdp_sock *, uint32_t *, uint64_t *);
+void xdp_refill(struct xdp_sock *, uint64_t);
+void xdp_sync(struct xdp_sock *);
+int xdp_drops(struct xdp_sock *, uint64_t *);
+
+#endif /* _XDP_H_ */